@@ -1,16 +1,79 @@
 // -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
 // vi:set ts=4 sts=4 sw=4 noet :
 
+// The pool of blocks shared by all files.
+// Every file is guaranteed the blocks added to the pool for its streams, futures and prefetching:
+// while it uses fewer than that, it may take any available block.
+// Blocks added for the job threads and the cache are shared by all files, and a file using more
+// than its own blocks may only take one of them if it is left for the files using fewer,
+// and it uses no more than its share of them, so one busy file can't starve the others.
+
 #include <file_stream_impl.h>
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <unordered_map>
 #include <unordered_set>
 #include <cassert>
 
 namespace {
-std::unordered_set<block *> available_blocks;
+// Blocks holding no data are at the front and used first,
+// the others follow in the order they became available, so the oldest is repurposed first
+std::list<block *> available_order;
+std::unordered_map<block *, std::list<block *>::iterator> available_blocks;
+
+void insert_available_block(block * b) {
+	bool empty = b->m_file == nullptr && b->m_shared == nullptr;
+	auto it = empty? available_order.insert(available_order.begin(), b): available_order.insert(available_order.end(), b);
+	available_blocks.emplace(b, it);
+}
+
+// Number of blocks, and the number of them added for files
+size_t total_blocks = 0;
+size_t file_blocks = 0;
+// Sum over the files of the blocks they are guaranteed but don't use
+size_t reserved_blocks = 0;
+// Number of files using more blocks than they added
+size_t busy_files = 0;
+// Number of blocks with staged bytes, see open_flags::stage_serialized
+size_t staged_blocks = 0;
+
+void update_quota(file_impl * f, size_t pool_blocks, size_t used_blocks) {
+	reserved_blocks -= f->m_pool_blocks > f->m_used_blocks ? f->m_pool_blocks - f->m_used_blocks : 0;
+	busy_files -= f->m_used_blocks > f->m_pool_blocks;
+	f->m_pool_blocks = pool_blocks;
+	f->m_used_blocks = used_blocks;
+	reserved_blocks += f->m_pool_blocks > f->m_used_blocks ? f->m_pool_blocks - f->m_used_blocks : 0;
+	busy_files += f->m_used_blocks > f->m_pool_blocks;
+}
+
+// Can the file take a block from the pool
+bool may_take_block(file_impl * f) {
+	if (available_blocks.empty()) return false;
+	if (!f || f->m_used_blocks < f->m_pool_blocks) return true;
+	// The guaranteed blocks of the other files must stay in the pool
+	if (available_blocks.size() <= reserved_blocks) return false;
+	size_t shared = total_blocks - file_blocks;
+	size_t sharing = busy_files + (f->m_used_blocks == f->m_pool_blocks);
+	size_t share = std::max<size_t>(1, shared / sharing);
+	return f->m_used_blocks - f->m_pool_blocks < share;
+}
 }
 
 size_t ctr = 0;
 
+#ifndef NDEBUG
+// Blocks taken by files using at least the blocks they added, and the times
+// a file using fewer had to wait for a block, which the quotas should prevent
+std::atomic_int64_t total_borrowed_blocks, total_quota_waits;
+int64_t get_total_borrowed_blocks() {
+	return total_borrowed_blocks;
+}
+int64_t get_total_quota_waits() {
+	return total_quota_waits;
+}
+#endif
+
 #ifndef NDEBUG
 #include <unordered_map>
 std::unordered_set<block *> all_blocks;
@@ -49,11 +112,18 @@ void print_debug() {
 }
 #endif
 
-void create_available_block(lock_t &) {
+void create_available_block(lock_t &, file_impl * owner) {
 	auto b = new block();
 	b->m_idx = ctr++;
 	b->m_file = nullptr;
-	available_blocks.insert(b);
+	b->m_shared = nullptr;
+	b->m_callbacks = 0;
+	insert_available_block(b);
+	total_blocks++;
+	if (owner) {
+		file_blocks++;
+		update_quota(owner, owner->m_pool_blocks + 1, owner->m_used_blocks);
+	}
 	global_cond.notify_all();
 #ifndef NDEBUG
 	all_blocks.insert(b);
@@ -62,10 +132,17 @@ void create_available_block(lock_t &) {
 	log_info() << "AVAIL create     " << *b << std::endl;
 }
 
-block * pop_available_block(lock_t &);
-
-void destroy_available_block(lock_t & l) {
+void destroy_available_block(lock_t & l, file_impl * owner) {
+	if (owner) {
+		assert(owner->m_pool_blocks != 0);
+		file_blocks--;
+		update_quota(owner, owner->m_pool_blocks - 1, owner->m_used_blocks);
+		// Fewer blocks may be reserved now
+		global_cond.notify_all();
+	}
 	auto b = pop_available_block(l);
+	total_blocks--;
+	if (b->m_staged) staged_blocks--;
 	assert(b->m_usage == 0);
 	log_info() << "AVAIL destroy    " << *b << std::endl;
 #ifndef NDEBUG
@@ -75,31 +152,50 @@ void destroy_available_block(lock_t & l) {
 	delete b;
 }
 
+size_t pool_memory() {
+	lock_t l(global_mutex);
+	return total_blocks * sizeof(block) + staged_blocks * staged_buffer_size();
+}
+
 void push_available_block(lock_t &, block * b) {
 #ifndef NDEBUG
 	assert(available_blocks.count(b) == 0);
 #endif
 
-	available_blocks.insert(b);
+	insert_available_block(b);
+	if (file_impl * f = b->m_file)
+		update_quota(f, f->m_pool_blocks, f->m_used_blocks - 1);
 	global_cond.notify_all();
 	log_info() << "AVAIL push       " << *b << std::endl;
 }
 
 void make_block_unavailable(lock_t &, block * b) {
-	size_t res = available_blocks.erase(b);
-	assert(res == 1);
-	unused(res);
+	auto it = available_blocks.find(b);
+	assert(it != available_blocks.end());
+	available_order.erase(it->second);
+	available_blocks.erase(it);
+	if (file_impl * f = b->m_file)
+		update_quota(f, f->m_pool_blocks, f->m_used_blocks + 1);
 }
 
-block * pop_available_block(lock_t & l) {
+block * pop_available_block(lock_t & l, file_impl * file) {
 	while (true) {
-		while (available_blocks.empty()) global_cond.wait(l);
-		auto it = available_blocks.begin();
-		block * b = *it;
-		available_blocks.erase(it);
+#ifndef NDEBUG
+		if (file && file->m_used_blocks < file->m_pool_blocks && !may_take_block(file)) total_quota_waits++;
+#endif
+		while (!may_take_block(file)) global_cond.wait(l);
+#ifndef NDEBUG
+		if (file && file->m_used_blocks >= file->m_pool_blocks) total_borrowed_blocks++;
+#endif
+		block * b = available_order.front();
+		available_order.pop_front();
+		available_blocks.erase(b);
 		if (b->m_file) {
 			//log_info() << "\033[0;32mfree " << b->m_idx << " " << b->m_block << "\033[0m" << std::endl;
 			b->m_file->kill_block(l, b);
+		} else if (b->m_shared) {
+			// Kept after its file was closed
+			drop_shared_block(l, b);
 		}
 
 		b->m_logical_offset = no_file_size;
@@ -107,6 +203,16 @@ block * pop_available_block(lock_t & l) {
 		b->m_maximal_logical_size = no_block_size;
 		b->m_serialized_size = no_block_size;
 		b->m_dirty = false;
+		b->clear_dirty_range();
+		b->m_disk_logical_size = no_block_size;
+		b->m_staged_items = 0;
+		b->m_staged_chunk_count = 0;
+		// Blocks keep their staged bytes when other files reuse them, so blocks
+		// passed between files that stage and files that don't only allocate them once
+		if (file && file->m_stage_serialized && !b->m_staged) {
+			b->allocate_staged();
+			staged_blocks++;
+		}
 
 		b->m_block = 0;
 		b->m_file = nullptr;
@@ -114,10 +220,13 @@ block * pop_available_block(lock_t & l) {
 		b->m_readahead_usage = 0;
 		b->m_done_reading = true;
 		b->m_io = false;
+		b->m_checksum_error = false;
+		assert(b->m_callbacks == 0 && b->m_read_callbacks.empty());
 		b->m_prev_physical_size = no_block_size;
 		b->m_physical_size = no_block_size;
 		b->m_next_physical_size = no_block_size;
 		b->m_physical_offset = no_file_size;
+		if (file) update_quota(file, file->m_pool_blocks, file->m_used_blocks + 1);
 		log_info() << "AVAIL pop        " << *b << std::endl;
 		return b;
 	}
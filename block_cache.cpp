@@ -0,0 +1,131 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+// Blocks shared by the read only files opened on the same file.
+// A file is identified by its device, inode, size and modification time,
+// so a file that has been written since is not confused with the old contents,
+// and by the item codec, as the blocks hold unserialized items.
+// A block that is not in use can be taken over by another file with the same identity,
+// and the blocks of a closed file are kept in the pool until they are repurposed.
+// The pool gets shared_cache_blocks() more blocks when the first read only file is opened,
+// so there is room for them besides the blocks of the streams.
+
+#include <file_stream_impl.h>
+#include <sys/stat.h>
+#include <cassert>
+#include <map>
+#include <tuple>
+
+struct shared_file {
+	typedef std::tuple<dev_t, ino_t, off_t, int64_t, const item_codec *> key_t;
+	key_t key;
+	const item_codec * codec;
+	// The blocks files may take over, at most one for each block of the file
+	std::map<block_idx_t, block *> blocks;
+	// Number of open files with this identity
+	size_t files;
+};
+
+namespace {
+
+std::map<shared_file::key_t, shared_file> shared_files;
+// Number of blocks added to the pool for caching
+size_t cache_pool_blocks = 0;
+
+void release_if_unused(shared_file * f) {
+	if (f->files == 0 && f->blocks.empty())
+		shared_files.erase(f->key);
+}
+
+} //namespace
+
+shared_file * open_shared_file(lock_t & l, int fd, const item_codec * codec) {
+	struct stat st;
+	if (::fstat(fd, &st) != 0) return nullptr;
+	int64_t mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+	shared_file::key_t key(st.st_dev, st.st_ino, st.st_size, mtime, codec);
+
+	for (; cache_pool_blocks < shared_cache_blocks(); cache_pool_blocks++)
+		create_available_block(l);
+
+	auto it = shared_files.find(key);
+	if (it == shared_files.end())
+		it = shared_files.emplace(key, shared_file{key, codec, {}, 0}).first;
+	it->second.files++;
+	return &it->second;
+}
+
+void close_shared_file(lock_t &, shared_file * f) {
+	assert(f->files != 0);
+	f->files--;
+	release_if_unused(f);
+}
+
+void share_block(lock_t &, shared_file * f, block * b) {
+	assert(b->m_shared == nullptr);
+	// Another file may already share a block for this part of the file
+	if (!f->blocks.emplace(b->m_block, b).second) return;
+	b->m_shared = f;
+}
+
+void unshare_block(lock_t &, block * b) {
+	shared_file * f = b->m_shared;
+	if (!f) return;
+	size_t c = f->blocks.erase(b->m_block);
+	assert(c == 1);
+	unused(c);
+	b->m_shared = nullptr;
+	release_if_unused(f);
+}
+
+block * take_shared_block(lock_t &, shared_file * f, file_impl * file, block_idx_t idx) {
+	auto it = f->blocks.find(idx);
+	if (it == f->blocks.end()) return nullptr;
+	block * b = it->second;
+	// Blocks in use belong to the file using them, and blocks with errors are read again
+	if (b->m_usage != 0 || b->m_checksum_error) return nullptr;
+	assert(b->m_file != file && !b->m_io);
+
+	if (file_impl * old = b->m_file) {
+		// The old owner keeps its end position, as in kill_block
+		if (old->m_last_block == b) {
+			stream_position p;
+			p.m_block = b->m_block;
+			p.m_index = b->m_logical_size;
+			p.m_logical_offset = b->m_logical_offset;
+			p.m_physical_offset = b->m_physical_offset;
+			old->m_end_position = p;
+			old->m_last_block = nullptr;
+		}
+		size_t c = old->m_block_map.erase(idx);
+		assert(c == 1);
+		unused(c);
+	}
+	log_info() << "CACHE take       " << *b << std::endl;
+	b->m_file = file;
+	file->m_block_map.emplace(idx, b);
+	if (!file->m_last_block && file->m_end_position.m_block == idx)
+		file->m_last_block = b;
+	return b;
+}
+
+void keep_shared_block(lock_t &, block * b) {
+	assert(b->m_shared && b->m_usage == 0 && !b->m_checksum_error);
+	size_t c = b->m_file->m_block_map.erase(b->m_block);
+	assert(c == 1);
+	unused(c);
+	b->m_file = nullptr;
+	log_info() << "CACHE keep       " << *b << std::endl;
+}
+
+void drop_shared_block(lock_t & l, block * b) {
+	assert(b->m_file == nullptr);
+	const item_codec * codec = b->m_shared->codec;
+	if (codec->serialized) codec->destruct(b->m_data, b->m_logical_size);
+	unshare_block(l, b);
+}
+
+void destroy_shared_cache(lock_t & l) {
+	for (; cache_pool_blocks != 0; cache_pool_blocks--)
+		destroy_available_block(l);
+}
@@ -23,6 +23,7 @@ void print_header(size_t i, const block_header & header, bool head, ssize_t off)
 	          << "\tLogical offset: " << header.logical_offset << "\n"
 	          << "\tPhysical size: " << header.physical_size << "\n"
 	          << "\tLogical size: " << header.logical_size << "\n"
+	          << "\tChecksum: " << header.checksum << "\n"
 	          << "\n";
 }
 
@@ -86,10 +87,12 @@ bool check_file(const char * fname, bool log, bool dumpcontents) {
 		          << "\tVersion: " << h.version << (h.version == file_header::versionConst ? " (ok)" : " (wrong)")
 		          << "\n"
 		          << "\tBlocks: " << h.blocks << "\n"
+		          << "\tLast block offset: " << h.last_block_offset << "\n"
 		          << "\tUser data size: " << h.user_data_size << "\n"
 		          << "\tMax user data size: " << h.max_user_data_size << "\n"
 		          << "\tCompressed: " << h.isCompressed << "\n"
 		          << "\tSerialized: " << h.isSerialized << "\n"
+		          << "\tChecksums: " << h.hasChecksums << "\n"
 		          << "\n";
 	}
 
@@ -114,7 +117,9 @@ bool check_file(const char * fname, bool log, bool dumpcontents) {
 	file_size_t logical_offset = 0;
 
 	size_t i;
+	ssize_t last_block_offset = 0;
 	for (i = 0; off != size; i++) {
+		last_block_offset = off;
 		h1 = read_and_print_header(fd, i, true, log);
 		if (h1.logical_offset != logical_offset) {
 			std::cerr << "Wrong logical offset!\n";
@@ -157,6 +162,11 @@ bool check_file(const char * fname, bool log, bool dumpcontents) {
 		return false;
 	}
 
+	if (h.blocks != 0 && h.last_block_offset != static_cast<file_size_t>(last_block_offset)) {
+		std::cerr << "Last block is at " << last_block_offset << ", but file header specifies " << h.last_block_offset << "\n";
+		return false;
+	}
+
 	if (log) {
 		std::cout << "Total logical size: " << logical_offset << '\n'
 		          << "Total physical size: " << size << '\n';
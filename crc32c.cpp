@@ -0,0 +1,140 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+#include <crc32c.h>
+#include <string.h>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+#ifdef __SSE4_2__
+
+namespace {
+
+// The crc32 instruction has a latency of three cycles, so long buffers are
+// split in three lanes whose checksums are computed together and then combined.
+// Combining needs the effect of appending lane_size zero bytes to a checksum,
+// which is a linear operator on the checksum bits, see Mark Adler's crc32c.c.
+const size_t long_lane = 8192;
+const size_t short_lane = 256;
+
+const uint32_t poly = 0x82F63B78;
+
+uint32_t gf2_matrix_times(const uint32_t * mat, uint32_t vec) {
+	uint32_t sum = 0;
+	for (; vec; vec >>= 1, mat++)
+		if (vec & 1) sum ^= *mat;
+	return sum;
+}
+
+void gf2_matrix_square(uint32_t * square, const uint32_t * mat) {
+	for (int n = 0; n < 32; n++) square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+// Tables for appending len zero bytes to a checksum, len must be a power of two
+struct zeros_table {
+	uint32_t t[4][256];
+
+	zeros_table(size_t len) {
+		uint32_t even[32], odd[32];
+		// Operator for one zero bit
+		odd[0] = poly;
+		for (int n = 1; n < 32; n++) odd[n] = uint32_t(1) << (n - 1);
+		gf2_matrix_square(even, odd); // Two zero bits
+		gf2_matrix_square(odd, even); // Four zero bits
+		// Square until we have len zero bytes
+		uint32_t * op;
+		while (true) {
+			gf2_matrix_square(even, odd);
+			len >>= 1;
+			op = even;
+			if (len == 0) break;
+			gf2_matrix_square(odd, even);
+			len >>= 1;
+			op = odd;
+			if (len == 0) break;
+		}
+		for (uint32_t n = 0; n < 256; n++) {
+			t[0][n] = gf2_matrix_times(op, n);
+			t[1][n] = gf2_matrix_times(op, n << 8);
+			t[2][n] = gf2_matrix_times(op, n << 16);
+			t[3][n] = gf2_matrix_times(op, n << 24);
+		}
+	}
+
+	uint32_t shift(uint32_t crc) const {
+		return t[0][crc & 0xFF] ^ t[1][(crc >> 8) & 0xFF] ^ t[2][(crc >> 16) & 0xFF] ^ t[3][crc >> 24];
+	}
+};
+
+const zeros_table long_zeros(long_lane);
+const zeros_table short_zeros(short_lane);
+
+inline uint64_t load(const char * p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+// Computes three lanes of lane bytes at a time while size allows it
+inline void crc_lanes(uint64_t & c0, const char *& p, size_t & size, size_t lane, const zeros_table & zeros) {
+	while (size >= 3 * lane) {
+		uint64_t c1 = 0, c2 = 0;
+		const char * end = p + lane;
+		for (; p < end; p += 8) {
+			c0 = _mm_crc32_u64(c0, load(p));
+			c1 = _mm_crc32_u64(c1, load(p + lane));
+			c2 = _mm_crc32_u64(c2, load(p + 2 * lane));
+		}
+		c0 = zeros.shift(static_cast<uint32_t>(c0)) ^ c1;
+		c0 = zeros.shift(static_cast<uint32_t>(c0)) ^ c2;
+		p += 2 * lane;
+		size -= 3 * lane;
+	}
+}
+
+} //namespace
+
+uint32_t crc32c(const void * data, size_t size, uint32_t crc) {
+	const char * p = static_cast<const char *>(data);
+	uint64_t c = ~crc;
+	crc_lanes(c, p, size, long_lane, long_zeros);
+	crc_lanes(c, p, size, short_lane, short_zeros);
+	for (; size >= 8; size -= 8, p += 8)
+		c = _mm_crc32_u64(c, load(p));
+	uint32_t c32 = static_cast<uint32_t>(c);
+	for (; size > 0; size--, p++)
+		c32 = _mm_crc32_u8(c32, static_cast<uint8_t>(*p));
+	return ~c32;
+}
+
+#else
+
+namespace {
+
+struct crc_table {
+	uint32_t t[256];
+
+	crc_table() {
+		// Reflected Castagnoli polynomial
+		const uint32_t poly = 0x82F63B78;
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++) c = (c & 1)? (c >> 1) ^ poly: c >> 1;
+			t[i] = c;
+		}
+	}
+};
+
+const crc_table table;
+
+} //namespace
+
+uint32_t crc32c(const void * data, size_t size, uint32_t crc) {
+	const unsigned char * p = static_cast<const unsigned char *>(data);
+	uint32_t c = ~crc;
+	for (size_t i = 0; i < size; i++)
+		c = table.t[(c ^ p[i]) & 0xFF] ^ (c >> 8);
+	return ~c;
+}
+
+#endif
@@ -0,0 +1,16 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+///////////////////////////////////////////////////////////////////////////////
+/// \file crc32c.h  CRC32C (Castagnoli) checksums
+///
+/// Uses the SSE4.2 crc32 instruction when it is available at compile time
+/// and a table driven implementation otherwise. Both give the same result.
+///////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Extends the checksum crc with size bytes of data, start with crc = 0
+uint32_t crc32c(const void * data, size_t size, uint32_t crc = 0);
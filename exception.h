@@ -1,6 +1,8 @@
 #pragma once
 
 #include <exception>
+#include <stdexcept>
+#include <string>
 
 struct exception : public std::runtime_error {
 	exception(const std::string & s) : std::runtime_error(s) {}
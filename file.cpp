@@ -4,19 +4,42 @@
 #include <file_utils.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <cassert>
+#include <cstdlib>
 #include <cstring>
 #include "exception.h"
 
 void execute_read_job(lock_t & job_lock, file_impl * file, block * b);
 void execute_truncate_job(lock_t & job_lock, file_impl * file, file_size_t truncate_size);
 
+namespace {
+
+// Creates an anonymous file in the directory dir, see open_flags::temporary
+int open_temporary(const std::string & dir) {
+#ifdef O_TMPFILE
+	int fd = ::open(dir.c_str(), O_TMPFILE | O_RDWR, 00600);
+	if (fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)) return fd;
+#endif
+	// The file system can't create anonymous files, so create a named file and unlink it
+	std::string path = dir + "/tpie_XXXXXX";
+	int named_fd = ::mkstemp(&path[0]);
+	if (named_fd != -1) ::unlink(path.c_str());
+	return named_fd;
+}
+
+// Bytes used by all files in memory, protected by the global mutex, see open_flags::in_memory
+file_size_t in_memory_bytes = 0;
+
+} //namespace
+
 const uint64_t file_header::magicConst;
 const uint64_t file_header::versionConst;
 
-file_impl::file_impl(file_base_base * outer, bool serialized, block_size_t item_size)
+file_impl::file_impl(file_base_base * outer, const item_codec * codec)
 	: m_outer(outer)
 	, m_fd(-1)
 #ifndef NDEBUG
@@ -25,18 +48,39 @@ file_impl::file_impl(file_base_base * outer, bool serialized, block_size_t item_
 	, m_last_block(nullptr)
 	, m_blocks(0)
 	, m_job_count(0)
-	, m_item_size(item_size)
-	, m_serialized(serialized) {
+	, m_codec(codec)
+	, m_item_size(codec->item_size)
+	, m_serialized(codec->serialized)
+	, m_trivially_serializable(codec->trivially_serializable)
+	, m_advice(access_pattern::normal)
+	, m_prefetch_window(0)
+	, m_futures(0)
+	, m_pool_blocks(0)
+	, m_used_blocks(0)
+	, m_shared(nullptr)
+	, m_in_memory(false)
+	, m_spill(false)
+	, m_memory_size(0)
+	, m_read_only_size(0)
+	, m_committed_blocks(0)
+	, m_committed_offset(0)
+	, m_checkpoint_blocks(0)
+	, m_writing_checkpoint(false)
+	, m_allocated_end(0)
+	, m_preallocation(default_preallocation())
+	, m_disk_preallocation(default_preallocation())
+	, m_sync_error(0)
+	, m_sync_running(false) {
 }
 
 file_base_base::~file_base_base() {
 	delete m_impl;
 }
 
-file_base_base::file_base_base(bool serialized, block_size_t item_size)
+file_base_base::file_base_base(const item_codec * codec)
 	: m_impl(nullptr)
 {
-	m_impl = new file_impl(this, serialized, item_size);
+	m_impl = new file_impl(this, codec);
 }
 
 file_base_base::file_base_base(file_base_base && o)
@@ -75,6 +119,8 @@ void file_base_base::open(const std::string & path, open_flags::open_flags flags
 		throw exception("File is already open");
 	if ((flags & open_flags::read_only) && (flags & open_flags::truncate))
 		throw exception("Can't open file as truncated with read only flag");
+	if ((flags & open_flags::read_only) && (flags & (open_flags::temporary | open_flags::in_memory)))
+		throw exception("Can't open a temporary file with read only flag");
 
 	m_impl->m_path = path;
 
@@ -88,10 +134,31 @@ void file_base_base::open(const std::string & path, open_flags::open_flags flags
 	}
 
 	m_impl->m_readonly = flags & open_flags::read_only;
+	m_impl->m_in_memory = flags & open_flags::in_memory;
+	m_impl->m_temporary = m_impl->m_in_memory || (flags & open_flags::temporary);
+	m_impl->m_spill = false;
+	m_impl->m_sync_error = 0;
+	m_impl->m_memory_size = 0;
 	m_impl->m_compressed = !(flags & open_flags::no_compress);
+	m_impl->m_integer_codec = m_impl->m_compressed && (flags & open_flags::integer_codec);
+	if (m_impl->m_integer_codec && !(m_impl->m_codec->integral && m_impl->plain_items()))
+		throw exception("The integer codec can only be used for integral items");
+	m_impl->m_shuffle = m_impl->m_compressed && (flags & open_flags::byte_shuffle);
+	if (m_impl->m_shuffle && (!m_impl->plain_items() || m_impl->m_integer_codec))
+		throw exception("Byte shuffling can only be used for items stored as their bytes without the integer codec");
+	m_impl->m_checksum = flags & open_flags::checksum;
 	m_impl->m_readahead = !(flags & open_flags::no_readahead);
-
-	int fd = ::open(path.c_str(), posix_flags, 00660);
+	m_impl->m_stage_serialized = (flags & open_flags::stage_serialized) && !m_impl->m_readonly && !m_impl->plain_items();
+	m_impl->m_advice = access_pattern::normal;
+
+	int fd = -1;
+	if (m_impl->m_in_memory) {
+		fd = ::memfd_create("tpie", 0);
+		// Without memfd the file starts out on disk
+		if (fd == -1) m_impl->m_in_memory = false;
+	}
+	if (fd == -1)
+		fd = m_impl->m_temporary? open_temporary(path): ::open(path.c_str(), posix_flags, 00660);
 	if (fd == -1)
 		throw exception("Failed to open file: " + std::string(std::strerror(errno)));
 
@@ -131,27 +198,55 @@ void file_base_base::open(const std::string & path, open_flags::open_flags flags
 			throw exception("Invalid TPIE file (wrong serialized)");
 		}
 
+		if (header.isIntegerCoded && !(m_impl->m_codec->integral && m_impl->plain_items()))
+			throw exception("Invalid TPIE file (integer coded)");
+		m_impl->m_integer_codec = header.isIntegerCoded;
+		if (header.isShuffled && !m_impl->plain_items())
+			throw exception("Invalid TPIE file (shuffled)");
+		m_impl->m_shuffle = header.isShuffled;
+		m_impl->m_checksum = header.hasChecksums;
+
 		assert(max_user_data_size == 0 || header.max_user_data_size == max_user_data_size);
 
 		m_impl->m_blocks = header.blocks;
 
+		// The header may be a checkpoint written before the file was closed,
+		// so the end of the file is found from the last block it counts
+		file_size_t end;
 		if (header.blocks > 0) {
-			assert(fsize >= sizeof(file_header) + header.max_user_data_size + 2 * sizeof(block_header));
 			block_header last_header;
-			_pread(fd, &last_header, sizeof last_header, fsize - sizeof last_header);
+			_pread(fd, &last_header, sizeof last_header, header.last_block_offset);
+			end = header.last_block_offset + last_header.physical_size;
+			if (last_header.physical_size < 2 * sizeof(block_header) || end > fsize)
+				throw exception("Invalid TPIE file (last block past the end)");
 
 			stream_position p;
 			p.m_block = header.blocks - 1;
 			p.m_index = last_header.logical_size;
 			p.m_logical_offset = last_header.logical_offset;
-			p.m_physical_offset = fsize - last_header.physical_size;
+			p.m_physical_offset = header.last_block_offset;
 
 			m_impl->m_end_position = p;
 		} else {
-			assert(fsize == sizeof(file_header) + header.max_user_data_size);
-
 			m_impl->m_end_position = m_impl->start_position();
+			end = m_impl->m_end_position.m_physical_offset;
 		}
+
+		if (end != fsize && !m_impl->m_readonly) {
+			// Drop the blocks written after the last checkpoint
+			log_info() << "Cutting " << (fsize - end) << " bytes written after the last checkpoint\n";
+			int r = ::ftruncate(fd, end);
+			if (r != 0)
+				throw exception("Failed to truncate file: " + std::string(std::strerror(errno)));
+		}
+
+		m_impl->m_read_only_size = m_impl->m_end_position.m_logical_offset + m_impl->m_end_position.m_index;
+
+		m_impl->m_committed_blocks = header.blocks;
+		m_impl->m_committed_offset = header.last_block_offset;
+		m_impl->m_checkpoint_blocks = header.blocks;
+		m_impl->m_written_offsets.clear();
+		m_impl->m_allocated_end = end;
 	} else {
 		assert(!(flags & open_flags::read_only));
 
@@ -159,20 +254,35 @@ void file_base_base::open(const std::string & path, open_flags::open_flags flags
 		header.magic = file_header::magicConst;
 		header.version = file_header::versionConst;
 		header.blocks = 0;
+		header.last_block_offset = 0;
 		header.user_data_size = 0;
 		header.max_user_data_size = max_user_data_size;
 		header.isCompressed = m_impl->m_compressed;
 		header.isSerialized = m_impl->m_serialized;
-		// This isn't really needed, because the header will be written when we close the file.
-		// However if the file gets in an invalid state and we crash, it is nice to have a valid header.
-		_pwrite(fd, &header, sizeof header, 0);
-
-		void * zeros = calloc(max_user_data_size, 1);
-		_pwrite(fd, zeros, max_user_data_size, sizeof header);
-		free(zeros);
+		header.isIntegerCoded = m_impl->m_integer_codec;
+		header.isShuffled = m_impl->m_shuffle;
+		header.hasChecksums = m_impl->m_checksum;
+		if (!m_impl->m_temporary) {
+			// This isn't really needed, because the header will be written when we close the file.
+			// However if the file gets in an invalid state and we crash, it is nice to have a valid header.
+			_pwrite(fd, &header, sizeof header, 0);
+
+			void * zeros = calloc(max_user_data_size, 1);
+			_pwrite(fd, zeros, max_user_data_size, sizeof header);
+			free(zeros);
+		}
 
 		m_impl->m_end_position = m_impl->start_position();
+
+		m_impl->m_committed_blocks = 0;
+		m_impl->m_committed_offset = 0;
+		m_impl->m_checkpoint_blocks = 0;
+		m_impl->m_written_offsets.clear();
+		m_impl->m_allocated_end = 0;
 	}
+	m_impl->m_preallocation = m_impl->m_readonly || m_impl->m_in_memory? 0: default_preallocation();
+	m_impl->m_disk_preallocation = default_preallocation();
+	if (m_impl->m_readonly) m_impl->m_shared = open_shared_file(l, fd, m_impl->m_codec);
 }
 
 void file_base_base::close() {
@@ -181,35 +291,107 @@ void file_base_base::close() {
 
 	lock_t l(global_mutex);
 
+	// Checked before anything is changed, so a close that throws leaves the file as it was
+	if (!m_impl->m_streams.empty())
+		throw exception("Tried to close a file with open streams");
+	if (m_impl->m_futures != 0)
+		throw exception("Tried to close a file with block futures");
+
+	m_impl->free_prefetch_blocks(l);
+
 	// Wait for all jobs to be completed for this file
 	while (m_impl->m_job_count) global_cond.wait(l);
 
-	if (!m_impl->m_streams.empty())
-		throw exception("Tried to close a file with open streams");
+	m_impl->finish_close(l);
+}
 
-	// Kill all blocks
-	m_impl->foreach_block([&](block * b){
-		assert(b->m_usage == 0);
-		m_impl->kill_block(l, b);
-	});
+io_future file_base_base::flush_async() {
+	assert(is_open());
+	io_future f;
+	f.m_state = std::make_shared<io_state>();
 
-	assert(m_impl->m_block_map.size() == 0);
+	lock_t l(global_mutex);
+	m_impl->m_flushes.push_back(f.m_state);
+	if (m_impl->m_job_count == 0) m_impl->finish_flushes(l);
+	return f;
+}
+
+io_future file_base_base::sync_async() {
+	assert(is_open());
+	io_future f;
+	f.m_state = std::make_shared<io_state>();
+
+	lock_t l(global_mutex);
+	m_impl->m_syncs.push_back(f.m_state);
+	if (m_impl->m_job_count == 0) m_impl->start_syncs(l);
+	return f;
+}
+
+void file_base_base::sync() {
+	sync_async().wait();
+}
+
+io_future file_base_base::close_async() {
+	if (!is_open())
+		throw exception("File is already closed");
+
+	lock_t l(global_mutex);
 
-	if (!m_impl->m_readonly) {
-		// Write out header
-		m_impl->m_header.blocks = m_impl->m_blocks;
-		_pwrite(m_impl->m_fd, &m_impl->m_header, sizeof(file_header), 0);
+	if (!m_impl->m_streams.empty())
+		throw exception("Tried to close a file with open streams");
+	if (m_impl->m_futures != 0)
+		throw exception("Tried to close a file with block futures");
+
+	// Done here, as the job thread finishing the close must not wait for available blocks
+	m_impl->free_prefetch_blocks(l);
+	for (; m_impl->m_prefetch_window != 0; m_impl->m_prefetch_window--)
+		destroy_available_block(l, m_impl);
+
+	io_future f;
+	f.m_state = std::make_shared<io_state>();
+
+	// The old file is finished by the last of its jobs, see file_impl::job_done
+	file_impl * closing = m_impl;
+	m_impl = new file_impl(this, closing->m_codec);
+	closing->m_outer = nullptr;
+	closing->m_close = f.m_state;
+	if (closing->m_job_count == 0) {
+		closing->finish_close(l);
+		delete closing;
 	}
+	return f;
+}
 
-	::close(m_impl->m_fd);
-	m_impl->m_fd = -1;
-	m_impl->m_path = "";
+void close_all(const std::vector<file_base_base *> & files) {
+	std::vector<io_future> closes;
+	closes.reserve(files.size());
+	for (file_base_base * f : files)
+		closes.push_back(f->close_async());
+	for (auto & c : closes)
+		c.wait();
+}
 
-	m_impl->m_blocks = 0;
+void sync_all(const std::vector<file_base_base *> & files) {
+	std::vector<io_future> syncs;
+	syncs.reserve(files.size());
+	for (file_base_base * f : files)
+		syncs.push_back(f->sync_async());
+	for (auto & s : syncs)
+		s.wait();
+}
 
-#ifndef NDEBUG
-	m_impl->m_file_id = file_impl::file_ctr++;
-#endif
+bool io_future::ready() const {
+	assert(valid());
+	lock_t l(global_mutex);
+	return m_state->m_done;
+}
+
+void io_future::wait() const {
+	assert(valid());
+	lock_t l(global_mutex);
+	while (!m_state->m_done) global_cond.wait(l);
+	if (m_state->m_error != 0)
+		throw exception("Failed to sync file: " + std::string(std::strerror(m_state->m_error)));
 }
 
 bool file_base_base::is_open() const noexcept {
@@ -229,6 +411,11 @@ bool file_base_base::direct() const noexcept {
 	return m_impl->direct();
 }
 
+bool file_base_base::in_memory() const {
+	lock_t l(global_mutex);
+	return m_impl->m_in_memory;
+}
+
 size_t file_base_base::user_data_size() const noexcept {
 	return m_impl->m_header.user_data_size;
 }
@@ -240,12 +427,17 @@ size_t file_base_base::max_user_data_size() const noexcept {
 void file_base_base::read_user_data(void *data, size_t count) {
 	assert(is_open());
 	assert(count <= user_data_size());
+	// A job thread may move a file in memory to disk, see file_impl::spill
+	lock_t l(global_mutex);
 	_pread(m_impl->m_fd, data, count, sizeof(file_header));
 }
 
 void file_base_base::write_user_data(const void *data, size_t count) {
 	assert(is_open() && is_readable());
 	assert(count <= max_user_data_size());
+	lock_t l(global_mutex);
+	// The data would be lost if it was written while the file is copied to disk
+	while (m_impl->m_spill) global_cond.wait(l);
 	_pwrite(m_impl->m_fd, data, count, sizeof(file_header));
 	m_impl->m_header.user_data_size = std::max(user_data_size(), count);
 }
@@ -254,6 +446,25 @@ const std::string &file_base_base::path() const noexcept {
 	return m_impl->m_path;
 }
 
+void file_base_base::set_preallocation(file_size_t bytes) {
+	assert(is_open() && is_writable());
+	lock_t l(global_mutex);
+	// Nothing is preallocated in memory, see file_impl::spill
+	if (m_impl->m_in_memory)
+		m_impl->m_disk_preallocation = bytes;
+	else
+		m_impl->m_preallocation = bytes;
+}
+
+void file_base_base::reserve(file_size_t bytes) {
+	assert(is_open() && is_writable());
+	lock_t l(global_mutex);
+	// Space is not reserved in memory
+	if (m_impl->m_in_memory) return;
+	file_size_t end = (file_size_t)::lseek(m_impl->m_fd, 0, SEEK_END);
+	m_impl->preallocate(end + bytes, 0);
+}
+
 void file_base_base::truncate(stream_position pos) {
 	assert(is_open() && is_writable());
 	lock_t l(global_mutex);
@@ -267,6 +478,7 @@ void file_base_base::truncate(stream_position pos) {
 
 	// Make sure no one uses blocks past this one and kill them all
 	// First free all readahead blocks...
+	m_impl->free_prefetch_blocks(l);
 	for (stream_impl * s : m_impl->m_streams) {
 		block *b = s->m_readahead_block;
 		if (b && b->m_block > pos.m_block) {
@@ -298,6 +510,8 @@ void file_base_base::truncate(stream_position pos) {
 	m_impl->m_last_block = new_last_block;
 
 	m_impl->m_blocks = pos.m_block + 1;
+	// The size of the next block may have been read with this block, but that block is gone
+	new_last_block->m_next_physical_size = no_block_size;
 
 	assert(pos.m_index <= new_last_block->m_logical_size);
 	block_size_t truncated_items = new_last_block->m_logical_size - pos.m_index;
@@ -310,15 +524,19 @@ void file_base_base::truncate(stream_position pos) {
 	if (truncated_items != 0) {
 		// We need to remove some items from the block
 		if (m_impl->m_serialized) {
-			do_destruct(new_last_block->m_data + m_impl->m_item_size * pos.m_index, truncated_items);
+			m_impl->do_destruct(new_last_block->m_data + m_impl->m_item_size * pos.m_index, truncated_items);
 			// Update serialized size
-			do_serialize(new_last_block->m_data, pos.m_index, nullptr, &new_last_block->m_serialized_size);
+			m_impl->do_serialize(new_last_block->m_data, pos.m_index, nullptr, &new_last_block->m_serialized_size);
+			// The staged bytes no longer match the items
+			new_last_block->m_staged_items = 0;
+			new_last_block->m_staged_chunk_count = 0;
 		}
 		// We don't know this blocks physical_size and we mark it as dirty
 		// We don't actually write this block yet, but just truncate the file to only include the previous blocks
 		new_last_block->m_physical_size = no_block_size;
 		m_impl->update_related_physical_sizes(l, new_last_block);
 		new_last_block->m_dirty = true;
+		new_last_block->m_disk_logical_size = no_block_size;
 
 		truncate_size = new_last_block->m_physical_offset;
 	} else {
@@ -350,9 +568,12 @@ void file_base_base::truncate(stream_position pos) {
 
 	log_info() << "FILE  trunc       " << truncate_size << std::endl;
 
+	// The new last block is kept on disk unless the file is truncated at its start
+	m_impl->uncommit_blocks(l, truncate_size == new_last_block->m_physical_offset? pos.m_block: pos.m_block + 1, truncate_size);
+
 	m_impl->m_job_count++;
 	execute_truncate_job(l, this->m_impl, truncate_size);
-	m_impl->m_job_count--;
+	m_impl->job_done(l);
 
 	// We can only free the new last block after the file has been truncated
 	m_impl->free_block(l, new_last_block);
@@ -367,14 +588,222 @@ void file_base_base::truncate(file_size_t offset) {
 	truncate(p);
 }
 
+void file_base_base::advise(access_pattern pattern) {
+	assert(is_open());
+	lock_t l(global_mutex);
+	m_impl->m_advice = pattern;
+
+	int advice = POSIX_FADV_NORMAL;
+	switch (pattern) {
+	case access_pattern::normal: advice = POSIX_FADV_NORMAL; break;
+	case access_pattern::sequential: advice = POSIX_FADV_SEQUENTIAL; break;
+	case access_pattern::reverse: advice = POSIX_FADV_NORMAL; break;
+	case access_pattern::random: advice = POSIX_FADV_RANDOM; break;
+	}
+	posix_fadvise64(m_impl->m_fd, 0, 0, advice);
+}
+
+void file_base_base::prefetch(stream_position p) {
+	assert(is_open());
+	lock_t l(global_mutex);
+	m_impl->prefetch(l, p);
+}
+
+void file_base_base::prefetch(file_size_t offset, file_size_t count) {
+	assert(is_open());
+	lock_t l(global_mutex);
+	if (count == 0 || offset >= size()) return;
+
+	if (!direct()) {
+		// We can only find the position of the first block
+		if (offset == 0) m_impl->prefetch(l, m_impl->start_position());
+		return;
+	}
+
+	file_size_t end = std::min(offset + count, size());
+	stream_position p = m_impl->position_from_offset(l, offset);
+	stream_position last = m_impl->position_from_offset(l, end - 1);
+	// Only the last max_prefetch_blocks() blocks would be kept
+	if (last.m_block >= p.m_block + max_prefetch_blocks())
+		p = m_impl->position_from_offset(l, (last.m_block + 1 - max_prefetch_blocks()) * (block_size() / m_impl->m_item_size));
+
+	while (true) {
+		m_impl->prefetch(l, p);
+		if (p.m_block == last.m_block) break;
+		p.m_block++;
+		p.m_logical_offset += block_size() / m_impl->m_item_size;
+		p.m_physical_offset += block_size() + 2 * sizeof(block_header);
+		p.m_index = 0;
+	}
+}
+
+void file_base_base::drop(file_size_t offset, file_size_t count) {
+	assert(is_open());
+	lock_t l(global_mutex);
+	file_size_t end = offset + count;
+	if (count == 0) return;
+
+	auto overlaps = [&](block * b) {
+		if (!is_known(b->m_logical_offset)) return false;
+		file_size_t items = is_known(b->m_logical_size)? b->m_logical_size: 1;
+		return b->m_logical_offset < end && offset < b->m_logical_offset + std::max<file_size_t>(items, 1);
+	};
+
+	auto & prefetched = m_impl->m_prefetch_blocks;
+	for (auto it = prefetched.begin(); it != prefetched.end();) {
+		if (overlaps(*it)) {
+			m_impl->free_readahead_block(l, *it);
+			it = prefetched.erase(it);
+		} else
+			++it;
+	}
+
+	m_impl->foreach_block([&](block * b) {
+		if (b->m_usage != 0 || b->m_dirty || b->m_io || !overlaps(b)) return;
+		if (!is_known(b->m_physical_offset) || !is_known(b->m_physical_size)) return;
+		posix_fadvise64(m_impl->m_fd, b->m_physical_offset, b->m_physical_size, POSIX_FADV_DONTNEED);
+		m_impl->kill_block(l, b);
+	});
+
+	if (direct()) {
+		// Also drop pages of blocks that are no longer cached by us
+		stream_position first = m_impl->position_from_offset(l, offset);
+		file_size_t blocks = (end - first.m_logical_offset + block_size() / m_impl->m_item_size - 1) / (block_size() / m_impl->m_item_size);
+		posix_fadvise64(m_impl->m_fd, first.m_physical_offset, blocks * (block_size() + 2 * sizeof(block_header)), POSIX_FADV_DONTNEED);
+	}
+}
+
+std::vector<stream_position> file_base_base::block_positions() {
+	assert(is_open());
+	std::vector<stream_position> positions;
+	block_idx_t blocks;
+	{
+		lock_t l(global_mutex);
+		// Blocks being written must be on disk before their headers are read.
+		// The blocks of read only files don't change, so readers don't wait for each other.
+		if (!m_impl->m_readonly)
+			while (m_impl->m_job_count) global_cond.wait(l);
+		blocks = m_impl->m_blocks;
+		if (blocks == 0) return positions;
+		positions.reserve(blocks);
+		if (direct()) {
+			for (block_idx_t i = 0; i < blocks; i++)
+				positions.push_back(m_impl->position_from_offset(l, i * (block_size() / m_impl->m_item_size)));
+			return positions;
+		}
+	}
+
+	// Only the last block can be dirty, so the headers of the blocks before it
+	// are on disk and are read without holding the lock
+	stream_position p = m_impl->start_position();
+	positions.push_back(p);
+	for (block_idx_t i = 1; i < blocks; i++) {
+		block_header h;
+		_pread(m_impl->m_fd, &h, sizeof h, p.m_physical_offset);
+		if (h.logical_offset != p.m_logical_offset || h.physical_size < 2 * sizeof(block_header))
+			throw exception("Corrupt header of block " + std::to_string(p.m_block) + " in " + path());
+		p.m_block++;
+		p.m_logical_offset += h.logical_size;
+		p.m_physical_offset += h.physical_size;
+		positions.push_back(p);
+	}
+	return positions;
+}
+
+void file_base_base::read_async(block_future_base & f, stream_position p, std::function<void()> on_ready) {
+	assert(is_open());
+	f.reset();
+
+	lock_t l(global_mutex);
+	if (p.m_block >= m_impl->m_blocks)
+		throw exception("Tried to read a block past the end of the file");
+
+	// Like a stream, the future adds the block it uses to the pool
+	create_available_block(l, m_impl);
+	block * b = m_impl->get_block(l, p, true, nullptr, false);
+	m_impl->m_futures++;
+	f.m_file = m_impl;
+	f.m_block = b;
+
+	if (!on_ready) return;
+	if (!b->m_done_reading) {
+		b->m_read_callbacks.push_back(std::move(on_ready));
+		b->m_callbacks++;
+		return;
+	}
+	l.unlock();
+	on_ready();
+}
+
+block_future_base::block_future_base(block_future_base && o) noexcept
+	: m_file(o.m_file)
+	, m_block(o.m_block) {
+	o.m_file = nullptr;
+	o.m_block = nullptr;
+}
+
+block_future_base & block_future_base::operator=(block_future_base && o) noexcept {
+	if (this == &o) return *this;
+	reset();
+	m_file = o.m_file;
+	m_block = o.m_block;
+	o.m_file = nullptr;
+	o.m_block = nullptr;
+	return *this;
+}
+
+bool block_future_base::ready() const {
+	assert(valid());
+	lock_t l(global_mutex);
+	return static_cast<block *>(m_block)->m_done_reading;
+}
+
+void block_future_base::wait() const {
+	assert(valid());
+	lock_t l(global_mutex);
+	block * b = static_cast<block *>(m_block);
+	while (!b->m_done_reading || b->m_callbacks != 0) global_cond.wait(l);
+	if (b->m_checksum_error) throw m_file->checksum_error(b);
+}
+
+void block_future_base::reset() {
+	if (!m_block) return;
+	lock_t l(global_mutex);
+	// The callbacks may refer to things that are gone once we return
+	while (static_cast<block *>(m_block)->m_callbacks != 0) global_cond.wait(l);
+	m_file->free_block(l, static_cast<block *>(m_block));
+	m_file->m_futures--;
+	destroy_available_block(l, m_file);
+	m_file = nullptr;
+	m_block = nullptr;
+}
+
+bool block_future_base::last() const {
+	assert(valid());
+	lock_t l(global_mutex);
+	return static_cast<block *>(m_block)->m_block + 1 == m_file->m_blocks;
+}
+
+stream_position block_future_base::position() const {
+	block * b = static_cast<block *>(m_block);
+	return {b->m_block, 0, b->m_logical_offset, b->m_physical_offset};
+}
+
+stream_position block_future_base::next_position() const {
+	block * b = static_cast<block *>(m_block);
+	assert(is_known(b->m_physical_size));
+	return {b->m_block + 1, 0, b->m_logical_offset + b->m_logical_size, b->m_physical_offset + b->m_physical_size};
+}
+
 file_size_t file_base_base::size() const noexcept {
+	if (m_impl->m_readonly) return m_impl->m_read_only_size;
 	if (!m_impl->m_last_block)
 		return m_impl->m_end_position.m_logical_offset + m_impl->m_end_position.m_index;
 	return m_impl->m_last_block->m_logical_offset + m_impl->m_last_block->m_logical_size;
 }
 
 #ifndef NDEBUG
-size_t file_impl::file_ctr = 0;
+std::atomic<size_t> file_impl::file_ctr(0);
 #endif
 
 stream_position file_impl::position_from_offset(lock_t &l, file_size_t offset) {
@@ -388,7 +817,7 @@ stream_position file_impl::position_from_offset(lock_t &l, file_size_t offset) {
 		p.m_physical_offset = start_position().m_physical_offset + p.m_block * (sizeof(block_header) * 2 + block_size());
 	} else if (offset == 0) {
 		p = start_position();
-	} else if (offset != m_outer->size()) {
+	} else if (offset == m_outer->size()) {
 		p = end_position(l);
 	} else {
 		throw std::runtime_error("Arbitrary offset find not supported for compressed or serialized files");
@@ -476,6 +905,8 @@ block * file_impl::get_block(lock_t & l, stream_position p, bool find_next, bloc
 	log_info() << "FILE  get_block  " << p.m_block << std::endl;
 
 	block * b = get_available_block(l, p.m_block);
+	// Another file opened on the same file may have the block
+	if (!b && m_shared) b = take_shared_block(l, m_shared, this, p.m_block);
 	if (b) {
 		log_info() << "FILE  fetch      " << *b << std::endl;
 		assert(b->m_block < m_blocks);
@@ -496,12 +927,18 @@ block * file_impl::get_block(lock_t & l, stream_position p, bool find_next, bloc
 			if (direct() && m_outer->is_writable()) {
 				while (b->m_io) global_cond.wait(l);
 			}
+
+			if (b->m_checksum_error) {
+				exception e = checksum_error(b);
+				free_block(l, b);
+				throw e;
+			}
 		}
 
 		return b;
 	}
 	
-	b = pop_available_block(l);
+	b = pop_available_block(l, this);
 
 	b->m_logical_offset = p.m_logical_offset;
 	b->m_maximal_logical_size = block_size() / m_item_size;
@@ -559,6 +996,7 @@ block * file_impl::get_block(lock_t & l, stream_position p, bool find_next, bloc
 	}
 
 	m_block_map.emplace(b->m_block, b);
+	if (m_shared) share_block(l, m_shared, b);
 
 	update_related_physical_sizes(l, b);
 
@@ -568,12 +1006,22 @@ block * file_impl::get_block(lock_t & l, stream_position p, bool find_next, bloc
 		++m_blocks;
 		b->m_logical_size = 0;
 		b->m_serialized_size = 0;
+		b->m_staged_items = 0;
+		b->m_staged_chunk_count = 0;
 
 		m_last_block = b;
 	} else {
 		log_info() << "FILE  read       " << *b << std::endl;
 		//We need to read stuff
 
+		if (direct()) {
+			// All blocks of a direct file except the last one are full,
+			// so we know the sizes without reading the neighbouring headers
+			block_size_t full_size = (block_size() / m_item_size) * m_item_size + 2 * sizeof(block_header);
+			if (b->m_block != 0) b->m_prev_physical_size = full_size;
+			if (b->m_block + 1 != m_blocks) b->m_physical_size = full_size;
+		}
+
 		m_job_count++;
 		b->m_usage++;
 		b->m_done_reading = false;
@@ -581,15 +1029,22 @@ block * file_impl::get_block(lock_t & l, stream_position p, bool find_next, bloc
 		b->m_io = true;
 
 		if (wait) {
+			// The block is read on this thread, which may be a reader thread
+			// other than the one that called file_stream_init
+			init_job_buffers();
 			execute_read_job(l, this, b);
-			m_job_count--;
+			job_done(l);
+			if (b->m_checksum_error) {
+				exception e = checksum_error(b);
+				free_block(l, b);
+				throw e;
+			}
 		} else {
 			job j;
 			j.type = job_type::read;
 			j.io_block = b;
 			j.file = this;
-			jobs.push(j);
-			global_cond.notify_all();
+			queue_job(l, j);
 		}
 	}
 
@@ -597,6 +1052,258 @@ block * file_impl::get_block(lock_t & l, stream_position p, bool find_next, bloc
 }
 	
 
+void file_impl::commit_block(lock_t & l, block_idx_t block, file_size_t physical_offset) {
+	// Blocks before m_committed_blocks are rewritten in place, which doesn't change the checkpoint
+	if (block < m_committed_blocks) return;
+	m_written_offsets[block] = physical_offset;
+
+	for (auto it = m_written_offsets.begin(); it != m_written_offsets.end() && it->first == m_committed_blocks;) {
+		m_committed_offset = it->second;
+		m_committed_blocks++;
+		it = m_written_offsets.erase(it);
+	}
+
+	if (!m_sync_running && m_committed_blocks >= m_checkpoint_blocks + checkpoint_blocks())
+		write_checkpoint(l);
+}
+
+void file_impl::uncommit_blocks(lock_t & l, block_idx_t kept_blocks, file_size_t truncate_size) {
+	m_written_offsets.erase(m_written_offsets.lower_bound(kept_blocks), m_written_offsets.end());
+	if (m_committed_blocks <= kept_blocks) return;
+
+	m_committed_blocks = kept_blocks;
+	if (kept_blocks > 0) {
+		// The last kept block ends at truncate_size, so its trailing header is just before it
+		block_header h;
+		_pread(m_fd, &h, sizeof h, truncate_size - sizeof h);
+		m_committed_offset = truncate_size - h.physical_size;
+	} else {
+		m_committed_offset = 0;
+	}
+
+	// The checkpoint must not count the blocks we are about to remove
+	write_checkpoint(l);
+}
+
+void file_impl::write_checkpoint(lock_t & l, block_idx_t blocks, file_size_t offset) {
+	m_header.blocks = blocks;
+	m_header.last_block_offset = offset;
+	m_checkpoint_blocks = blocks;
+	// Nothing reads the header of a temporary file
+	if (m_temporary) return;
+
+	// One thread at a time writes the latest header, so an older one is never written over it.
+	// Writing it is a job of the file, so the file is not closed meanwhile.
+	while (m_writing_checkpoint) global_cond.wait(l);
+	m_writing_checkpoint = true;
+	m_job_count++;
+	file_header header = m_header;
+	l.unlock();
+	_pwrite(m_fd, &header, sizeof(file_header), 0);
+	l.lock();
+	m_job_count--;
+	m_writing_checkpoint = false;
+	global_cond.notify_all();
+	log_info() << "FILE  checkpoint  " << m_path << " at " << header.blocks << " blocks" << std::endl;
+}
+
+void file_impl::preallocate(file_size_t end, file_size_t ahead) {
+	file_size_t allocated = m_allocated_end;
+	while (end > allocated) {
+		// Whoever moves m_allocated_end allocates the space up to it
+		if (!m_allocated_end.compare_exchange_weak(allocated, end + ahead)) continue;
+		if (::fallocate(m_fd, FALLOC_FL_KEEP_SIZE, allocated, end + ahead - allocated) != 0) {
+			log_info() << "FILE  fallocate failed for " << m_path << ": " << std::strerror(errno) << std::endl;
+			// The space will be allocated when it is written, as without preallocation
+			m_preallocation = 0;
+		}
+		return;
+	}
+}
+
+void file_impl::trim_preallocation(file_size_t size) {
+	file_size_t allocated = m_allocated_end.exchange(size);
+	if (allocated <= size) return;
+	// Punching a hole past the end does nothing on some file systems, while truncating
+	// to the same size releases the space past the end
+	if (::ftruncate(m_fd, size) != 0)
+		log_info() << "FILE  ftruncate failed for " << m_path << ": " << std::strerror(errno) << std::endl;
+}
+
+void file_impl::memory_size_changed(lock_t &, file_size_t size) {
+	if (!m_in_memory) return;
+	in_memory_bytes = in_memory_bytes - m_memory_size + size;
+	m_memory_size = size;
+	if (size > max_in_memory_file_size() || in_memory_bytes > max_in_memory_bytes())
+		m_spill = true;
+}
+
+void file_impl::spill(lock_t & l) {
+	assert(m_in_memory && m_job_count == m_held_jobs.size());
+	// The copy is a job of the file, so the file is not closed, truncated or synced meanwhile.
+	// The file may still be read, as its data is the same in memory and on disk.
+	m_job_count++;
+	l.unlock();
+
+	file_size_t size = 0;
+	int fd = open_temporary(m_path);
+	if (fd == -1) {
+		log_info() << "FILE  failed to move file in memory to " << m_path << ": " << std::strerror(errno) << std::endl;
+	} else {
+		size = (file_size_t)::lseek(m_fd, 0, SEEK_END);
+		off_t offset = 0;
+		while ((file_size_t)offset < size) {
+			if (::sendfile(fd, m_fd, &offset, size - offset) <= 0) {
+				log_info() << "FILE  failed to move file in memory to " << m_path << ": " << std::strerror(errno) << std::endl;
+				::close(fd);
+				fd = -1;
+				break;
+			}
+		}
+	}
+
+	l.lock();
+	m_job_count--;
+	if (fd == -1) return;
+
+	// Nothing else needs to know, as the descriptor number stays the same
+	::dup2(fd, m_fd);
+	::close(fd);
+	posix_fadvise64(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	in_memory_bytes -= m_memory_size;
+	m_memory_size = 0;
+	m_in_memory = false;
+	m_allocated_end = size;
+	m_preallocation = m_disk_preallocation;
+	log_info() << "FILE  moved " << size << " bytes in memory to " << m_path << std::endl;
+}
+
+void file_impl::queue_job(lock_t &, const job & j) {
+	if (m_spill) {
+		m_held_jobs.push_back(j);
+		return;
+	}
+	jobs.push_back(j);
+	global_cond.notify_all();
+}
+
+void file_impl::job_done(lock_t & l, uint32_t count) {
+	assert(m_job_count >= count);
+	m_job_count -= count;
+
+	// Only the held jobs are left, so nothing writes to the file while it is moved
+	if (m_spill && m_job_count == m_held_jobs.size()) {
+		if (!m_close) spill(l);
+		m_spill = false;
+		for (const job & j : m_held_jobs) jobs.push_back(j);
+		m_held_jobs.clear();
+		global_cond.notify_all();
+	}
+	if (m_job_count != 0) return;
+
+	// Writing the checkpoint releases the lock, so jobs and flushes may be added meanwhile
+	while (!m_close && !m_flushes.empty()) {
+		finish_flushes(l);
+		if (m_job_count != 0) return;
+	}
+	// A sync is a job of the file, so a file closed by close_async is closed after it
+	start_syncs(l);
+	if (m_job_count != 0) return;
+
+	if (m_close) {
+		// Nothing refers to a file closed by close_async when it has no jobs
+		finish_close(l);
+		delete this;
+	}
+}
+
+void file_impl::finish_flushes(lock_t & l) {
+	if (m_flushes.empty()) return;
+	std::vector<std::shared_ptr<io_state>> flushes;
+	flushes.swap(m_flushes);
+	if (!m_readonly) write_checkpoint(l);
+	for (auto & f : flushes) f->m_done = true;
+	global_cond.notify_all();
+}
+
+void file_impl::start_syncs(lock_t & l) {
+	if (m_syncs.empty()) return;
+	// There is nothing to make durable in a read only or temporary file,
+	// and nothing can be made durable after a sync has failed
+	if (m_readonly || m_temporary || m_sync_error) {
+		for (auto & s : m_syncs) {
+			s->m_error = m_sync_error;
+			s->m_done = true;
+		}
+		m_syncs.clear();
+		global_cond.notify_all();
+		return;
+	}
+	m_job_count++;
+	m_sync_running = true;
+	queue_sync(l, this, std::move(m_syncs));
+	m_syncs.clear();
+}
+
+void file_impl::finish_close(lock_t & l) {
+	assert(m_job_count == 0 && m_streams.empty() && m_futures == 0 && m_syncs.empty());
+
+	// Kill all blocks, except shared blocks that are kept for the next file opened on this file
+	foreach_block([&](block * b){
+		assert(b->m_usage == 0);
+		if (b->m_shared && !b->m_checksum_error)
+			keep_shared_block(l, b);
+		else
+			kill_block(l, b);
+	});
+
+	assert(m_block_map.size() == 0);
+
+	if (m_shared) {
+		close_shared_file(l, m_shared);
+		m_shared = nullptr;
+	}
+
+	for (; m_prefetch_window != 0; m_prefetch_window--)
+		destroy_available_block(l, this);
+	assert(m_pool_blocks == 0 && m_used_blocks == 0);
+
+	if (!m_readonly) {
+		// Write out header, all blocks have been written now
+		assert(m_committed_blocks == m_blocks);
+		write_checkpoint(l);
+		trim_preallocation((file_size_t)::lseek(m_fd, 0, SEEK_END));
+	}
+
+	if (m_in_memory) {
+		in_memory_bytes -= m_memory_size;
+		m_memory_size = 0;
+		m_in_memory = false;
+	}
+	m_spill = false;
+
+	::close(m_fd);
+	m_fd = -1;
+	m_path = "";
+
+	m_blocks = 0;
+
+#ifndef NDEBUG
+	m_file_id = file_ctr++;
+#endif
+
+	for (auto & f : m_flushes) f->m_done = true;
+	m_flushes.clear();
+	if (m_close) m_close->m_done = true;
+	m_close.reset();
+	global_cond.notify_all();
+}
+
+exception file_impl::checksum_error(const block * b) const {
+	return exception("Checksum mismatch in block " + std::to_string(b->m_block) + " of " + m_path);
+}
+
 block * file_impl::get_successor_block(lock_t & l, block * b, bool wait) {
 	stream_position p;
 	p.m_block = b->m_block + 1;
@@ -624,6 +1331,35 @@ void file_impl::free_readahead_block(lock_t & l, block * b) {
 	free_block(l, b);
 }
 
+void file_impl::prefetch(lock_t & l, stream_position p) {
+	if (p.m_block >= m_blocks) return;
+
+	// Skip blocks that are already in use, including those we are reading ahead
+	auto it = m_block_map.find(p.m_block);
+	if (it != m_block_map.end() && it->second->m_usage != 0) return;
+
+	if (m_prefetch_blocks.size() == m_prefetch_window) {
+		if (m_prefetch_window < max_prefetch_blocks()) {
+			// Every block we hold needs a block in the pool
+			create_available_block(l, this);
+			m_prefetch_window++;
+		} else {
+			free_readahead_block(l, m_prefetch_blocks.front());
+			m_prefetch_blocks.pop_front();
+		}
+	}
+
+	block * b = get_block(l, p, true, nullptr, false);
+	b->m_readahead_usage++;
+	m_prefetch_blocks.push_back(b);
+}
+
+void file_impl::free_prefetch_blocks(lock_t & l) {
+	for (block * b : m_prefetch_blocks)
+		free_readahead_block(l, b);
+	m_prefetch_blocks.clear();
+}
+
 void file_impl::free_block(lock_t & l, block * b) {
 	if (b == nullptr) return;
 	assert(b->m_usage != 0);
@@ -640,7 +1376,7 @@ void file_impl::free_block(lock_t & l, block * b) {
 	if (b->m_dirty &&
 		b->m_logical_size != 0 &&
 		(b->m_usage == 0 || (!direct() && b->m_logical_size == b->m_maximal_logical_size))) {
-		assert(m_outer->is_writable());
+		assert(!m_readonly);
 
 		if (direct()) {
 			// We don't need to update related physical sizes for direct files
@@ -661,8 +1397,7 @@ void file_impl::free_block(lock_t & l, block * b) {
 		assert(!b->m_io);
 		b->m_io = true;
 		//log_info() << "write block " << *t << std::endl;
-		jobs.push(j);
-		global_cond.notify_all();
+		queue_job(l, j);
 
 		return;
 	}
@@ -698,7 +1433,7 @@ void file_impl::kill_block(lock_t & l, block * b) {
 	update_related_physical_sizes(l, b);
 
 	if (m_serialized)
-		m_outer->do_destruct(b->m_data, b->m_logical_size);
+		do_destruct(b->m_data, b->m_logical_size);
 
 	// If the last block is killed, we need to set m_end_position
 	if (b == m_last_block) {
@@ -716,4 +1451,5 @@ void file_impl::kill_block(lock_t & l, block * b) {
 	assert(c == 1);
 	unused(c);
 	b->m_file = nullptr;
+	unshare_block(l, b);
 }
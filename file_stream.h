@@ -6,11 +6,14 @@
 ///////////////////////////////////////////////////////////////////////////////
 
 #pragma once
+#include <algorithm>
 #include <memory>
+#include <functional>
 #include <cstdint>
 #include <string>
 #include <string.h>
 #include <cassert>
+#include <vector>
 
 #include <tpie/serialization2.h>
 #include <defaults.h>
@@ -21,6 +24,7 @@ class block_base;
 class file_impl;
 class file_base_base;
 class stream_impl;
+struct io_state;
 class stream_base_base;
 struct stream_position;
 
@@ -46,17 +50,83 @@ constexpr block_size_t block_size() {return FILE_STREAM_BLOCK_SIZE;}
 
 constexpr block_size_t max_serialized_block_size() {return block_size();}
 
+// Maximum number of blocks a file keeps read ahead by file level prefetching
+constexpr size_t max_prefetch_blocks() {return 8;}
+
+// Blocks added to the pool when the first read only file is opened, so the blocks
+// that read only files opened on the same file share stay cached when the files are closed
+constexpr size_t shared_cache_blocks() {return 8;}
+
+// Writable files rewrite their header when this many more blocks have been written,
+// so a file can be reopened at that point after the process crashes, see file_header.
+// Only the header written by a sync is sure to survive the machine crashing, see sync_async.
+constexpr size_t checkpoint_blocks() {return 8;}
+
+// Writable files preallocate disk space this many bytes past the blocks written at the end,
+// so the file system can give the file long extents, see file_base_base::set_preallocation
+constexpr file_size_t default_preallocation() {return 8 * block_size();}
+
+// Limits for files opened with open_flags::in_memory, in bytes of the file as it would be on disk
+constexpr file_size_t max_in_memory_file_size() {return 16 * block_size();}
+constexpr file_size_t max_in_memory_bytes() {return 256 * block_size();}
+
+// Compressed blocks are split into chunks of whole items.
+// This is the uncompressed size a chunk is filled up to, the last item may go past it.
+constexpr block_size_t compression_chunk_size() {return 64 * 1024;}
+
+// Items bigger than half a chunk each get their own chunk
+constexpr block_size_t max_compression_chunks() {return 2 * block_size() / compression_chunk_size() + 1;}
+
 // Some free standing methods
 void file_stream_init(size_t threads);
 void file_stream_term();
 
+// Bytes of memory used by the blocks of the pool, including their staged items, see open_flags::stage_serialized
+size_t pool_memory();
+
 struct block_header {
 	file_size_t logical_offset;
 	block_size_t physical_size;
 	block_size_t logical_size;
+	// CRC32C of the fields above and the payload in files opened with open_flags::checksum, otherwise 0
+	uint32_t checksum;
+	uint32_t reserved;
+};
+
+// Bytes allocated for the staged items of each block used by a file opened with open_flags::stage_serialized.
+// There is room for block headers before and after them like the data of the block,
+// and for an item of max_serialized_block_size() after the end of the block.
+constexpr size_t staged_buffer_size() {return 2 * max_serialized_block_size() + 4 * sizeof(block_header);}
+
+// The item type specific steps of reading and writing blocks.
+// An item_codec is assembled at compile time for every file_base<T, serialized>,
+// see item_codec_for, and the job threads call its functions once per block
+// or compression chunk, so the loops over the items are compiled for T.
+struct item_codec {
+	bool serialized;
+	bool trivially_serializable;
+	// Whether the items are integers that can use open_flags::integer_codec
+	bool integral;
+	block_size_t item_size;
+
+	// Serializes items from in to out until all in_items items are serialized or the output
+	// reaches out_limit bytes. Sets *out_size and returns the number of items serialized.
+	// If out is null the size is only counted.
+	block_size_t (*serialize)(const char * in, block_size_t in_items, char * out, block_size_t out_limit, block_size_t * out_size);
+
+	// Constructs in_items items in out from their serialized bytes in in
+	void (*unserialize)(const char * in, block_size_t in_items, char * out);
+
+	void (*destruct)(char * data, block_size_t items);
 };
 
 // Give implementations of needed types
+// End of a chunk of staged items, in bytes and items from the start of the block
+struct staged_chunk {
+	block_size_t m_bytes;
+	block_size_t m_items;
+};
+
 class block_base {
 public:
 	file_size_t m_logical_offset;
@@ -65,6 +135,19 @@ public:
 	// Undefined for non-serialized blocks
 	block_size_t m_serialized_size;
 	bool m_dirty;
+	// The items [m_dirty_first, m_dirty_last) have been overwritten since the block was
+	// last read or written, the range is empty when m_dirty_first > m_dirty_last.
+	// Items appended to the block are not included.
+	block_size_t m_dirty_first;
+	block_size_t m_dirty_last;
+
+	// Serialized bytes of the items, see open_flags::stage_serialized.
+	// The first m_staged_items items are staged, split into the compression chunks
+	// ending at m_staged_chunks and a last chunk with the rest.
+	char * m_staged = nullptr;
+	block_size_t m_staged_items;
+	block_size_t m_staged_chunk_count;
+	staged_chunk m_staged_chunks[max_compression_chunks()];
 
 	// We make room for two block_header before and after
 	// the actual data
@@ -94,6 +177,32 @@ enum open_flags {
 	truncate = 1 << 1,
 	no_compress = 1 << 2,
 	no_readahead = 1 << 3,
+	// Serialize items once when they are written, instead of counting their size
+	// when written and serializing them when the block is written to disk.
+	// Every block the file uses takes another staged_buffer_size() bytes, about twice
+	// max_serialized_block_size(), for as long as the block is in the pool, see pool_memory.
+	stage_serialized = 1 << 4,
+	// Compress blocks of integers with delta encoding and bit packing instead of snappy,
+	// see integer_codec.h. Only for compressed files of integral items.
+	// Existing files are read with the codec they were created with.
+	integer_codec = 1 << 5,
+	// Group byte k of every item together before compressing blocks, see shuffle.h.
+	// Only for compressed files of items that are stored as their bytes, and not
+	// together with integer_codec. Existing files are read as they were created.
+	byte_shuffle = 1 << 6,
+	// Store a CRC32C checksum in the headers of each block and verify it when the block is read.
+	// A block that does not match makes the stream or future reading it throw an exception.
+	// Existing files are read as they were created.
+	checksum = 1 << 7,
+	// Create a new anonymous file in the directory given as the path, using O_TMPFILE when
+	// the file system supports it and otherwise a file that is unlinked right away.
+	// The file is removed when it is closed, and as nothing can open it again,
+	// its header is never written. Can't be combined with read_only.
+	temporary = 1 << 8,
+	// Like temporary, but the file is kept in memory until it is bigger than max_in_memory_file_size(),
+	// or all files in memory together use more than max_in_memory_bytes().
+	// It is then moved to a temporary file in the directory given as the path.
+	in_memory = 1 << 9,
 
 	// Alias for other flags
 	read_write = default_flags,
@@ -111,6 +220,78 @@ inline open_flags operator~(open_flags f) { return static_cast<open_flags>(~T(f)
 #undef T
 }
 
+// Expected access pattern of a file or stream.
+// Streams read ahead the next block when reading forward and the previous block
+// when reading backwards. With sequential or reverse only one of these is done,
+// and with random no blocks are read ahead.
+enum class access_pattern {normal, sequential, reverse, random};
+
+// Handle to a block that is read in the background, see file_base::read_async.
+// The block stays in memory until the handle is reset or destroyed.
+class block_future_base {
+public:
+	block_future_base() noexcept: m_file(nullptr), m_block(nullptr) {}
+	block_future_base(const block_future_base &) = delete;
+	block_future_base & operator=(const block_future_base &) = delete;
+	block_future_base(block_future_base && o) noexcept;
+	block_future_base & operator=(block_future_base && o) noexcept;
+	~block_future_base() {reset();}
+
+	bool valid() const noexcept {return m_block != nullptr;}
+
+	// Whether the block has been read, never waits
+	bool ready() const;
+
+	// Waits until the block has been read.
+	// Throws if the block did not match its checksum, see open_flags::checksum.
+	void wait() const;
+
+	// Releases the block
+	void reset();
+
+	// The following require the block to be ready
+	block_size_t size() const noexcept {return m_block->m_logical_size;}
+	file_size_t offset() const noexcept {return m_block->m_logical_offset;}
+	bool last() const;
+	stream_position position() const;
+	// Position of the first item of the next block, which can be passed to read_async
+	stream_position next_position() const;
+
+	friend class file_base_base;
+protected:
+	file_impl * m_file;
+	block_base * m_block;
+};
+
+template <typename T, bool serialized>
+class block_future: public block_future_base {
+public:
+	// The items of the block, there are size() of them
+	const T * data() const noexcept {return reinterpret_cast<const T *>(m_block->m_data);}
+	const T & operator[](size_t i) const noexcept {return data()[i];}
+};
+
+// Handle to a flush, sync or close running in the background, see file_base_base::flush_async
+class io_future {
+public:
+	bool valid() const noexcept {return bool(m_state);}
+
+	// Whether the flush, sync or close is done, never waits
+	bool ready() const;
+
+	// Waits until the flush, sync or close is done, and throws if a sync failed
+	void wait() const;
+
+	friend class file_base_base;
+private:
+	std::shared_ptr<io_state> m_state;
+};
+
+// Thread safety: a file and its streams are used from one thread at a time, with one exception.
+// A file opened with open_flags::read_only may be read by several threads at once,
+// when each thread creates and uses its own streams and block futures.
+// The threads share the blocks the file has in memory, and calls to size() don't need the lock.
+// Opening and closing the file must still happen while no other thread uses it.
 class file_base_base {
 public:
 	friend class file_impl;
@@ -125,6 +306,23 @@ public:
 	void open(const std::string & path, open_flags::open_flags flags = open_flags::default_flags, size_t max_user_data_size = 0);
 	void close();
 
+	// Writes the header once the blocks queued for writing so far are on disk,
+	// without waiting for them. Blocks held by streams or block futures are not written.
+	io_future flush_async();
+
+	// Closes the file without waiting for its blocks to be written.
+	// The file object is closed right away and can be opened again, while the job threads
+	// finish writing the old file. Wait for the handle before opening the same path again.
+	io_future close_async();
+
+	// Makes the blocks written so far and the header durable. The blocks are synced before
+	// the header counting them is written and synced, so it is never durable before them.
+	// The job threads sync the files of all syncs waiting at the same time together,
+	// so many files or threads syncing at once share the round trips to the disk.
+	// Waiting throws if fdatasync failed, and every later sync of the file fails as well.
+	io_future sync_async();
+	void sync();
+
 	bool is_open() const noexcept;
 	
 	bool is_readable() const noexcept;
@@ -132,6 +330,9 @@ public:
 
 	bool direct() const noexcept;
 
+	// Whether a file opened with open_flags::in_memory has not been moved to disk yet
+	bool in_memory() const;
+
 	size_t user_data_size() const noexcept;
 	size_t max_user_data_size() const noexcept;
 	void read_user_data(void * data, size_t count);
@@ -142,6 +343,37 @@ public:
 	void truncate(file_size_t offset);
 	void truncate(stream_position pos);
 
+	// Sets how many bytes of disk space are preallocated past the end of the file when
+	// blocks are written at the end, 0 turns it off. The space that is not used is released
+	// when the file is closed or truncated. A file in memory uses it once it is moved to disk.
+	void set_preallocation(file_size_t bytes);
+
+	// Preallocates disk space for bytes more bytes past the end of the file,
+	// e.g. right after opening a file whose size is known in advance
+	void reserve(file_size_t bytes);
+
+	// Sets the access pattern of streams created after this call
+	// and passes it on to the kernel
+	void advise(access_pattern pattern);
+
+	// Starts reading the block containing p in the background.
+	// At most max_prefetch_blocks() blocks are kept, the oldest are released first.
+	void prefetch(stream_position p);
+
+	// Starts reading the blocks containing the items [offset, offset + count).
+	// For compressed or serialized files only the first block can be found
+	// and offset must be 0 or the size of the file.
+	void prefetch(file_size_t offset, file_size_t count);
+
+	// Releases the cached blocks containing items in [offset, offset + count)
+	// that are not in use and tells the kernel the data is not needed
+	void drop(file_size_t offset, file_size_t count);
+
+	// Returns the position of the first item of every block.
+	// Compressed and serialized files read the sizes of the blocks from their headers,
+	// so the blocks written by a writable file are waited for first.
+	std::vector<stream_position> block_positions();
+
 	template <typename TT>
 	void read_user_data(TT & data) {
 		//if (sizeof(TT) != user_data_size()) throw io_exception("Wrong user data size");
@@ -157,18 +389,23 @@ public:
 	file_size_t size() const noexcept;
 
 protected:
-	file_base_base(bool serialized, block_size_t item_size);
+	void read_async(block_future_base & f, stream_position p, std::function<void()> on_ready);
+
+	file_base_base(const item_codec * codec);
 	virtual ~file_base_base();
 private:
-	virtual void do_serialize(const char * /*in*/, block_size_t /*in_items*/, char * /*out*/, block_size_t * /*out_size*/) {}
-	virtual void do_unserialize(const char * /*in*/, block_size_t /*in_items*/, char * /*out*/, block_size_t * /*out_size*/) {}
-	virtual void do_destruct(char * /*data*/, block_size_t /*size*/) {}
-
 	void impl_changed();
 
 	file_impl * m_impl;
 };
 
+// Closes the files with close_async and waits until all of them are closed,
+// so the pending writes of all the files overlap
+void close_all(const std::vector<file_base_base *> & files);
+
+// Syncs the files and waits until all of them are durable, in as few group commits as possible
+void sync_all(const std::vector<file_base_base *> & files);
+
 enum class whence {set, cur, end};
 
 class stream_base_base {
@@ -212,11 +449,30 @@ public:
 	stream_position get_position();
 
 	void set_position(stream_position p);
+
+	// Sets the access pattern of this stream, see access_pattern
+	void advise(access_pattern pattern);
+
+	// Starts reading the block containing p in the background,
+	// replacing the block read ahead by this stream
+	void prefetch(stream_position p);
 	
 	friend class stream_impl;
 	friend class file_base_base;
 protected:
 	void serialize_block_overflow(block_size_t serialized_size);
+	void stage_overflow(block_size_t serialized_size);
+
+	// Adds an item serialized at the end of the staged bytes
+	void stage_item(block_size_t serialized_size) {
+		block_base * b = m_block;
+		block_size_t chunk_start = b->m_staged_chunk_count? b->m_staged_chunks[b->m_staged_chunk_count - 1].m_bytes: 0;
+		b->m_serialized_size += serialized_size;
+		b->m_staged_items++;
+		if (b->m_serialized_size - chunk_start >= compression_chunk_size())
+			b->m_staged_chunks[b->m_staged_chunk_count++] = {b->m_serialized_size, b->m_staged_items};
+	}
+
 	void next_block();
 	void prev_block();
 	stream_base_base(file_base_base * impl);
@@ -225,6 +481,100 @@ protected:
 	file_base_base * m_file_base;
 	stream_impl * m_impl;
 	block_size_t m_cur_index;
+	// The file was opened with open_flags::stage_serialized, so its blocks have staged bytes
+	bool m_stage_serialized;
+};
+
+// Serialized items that are just their bytes, for which we can skip the per item serialization
+template <typename T, bool serialized>
+constexpr bool plain_serialized() {return serialized && is_trivially_serializable<T>::value;}
+
+template <typename T, bool serialized>
+struct item_codec_for {
+	static block_size_t serialize_items(const char * in, block_size_t in_items, char * out, block_size_t out_limit, block_size_t * out_size) {
+		const T * items = reinterpret_cast<const T *>(in);
+		if constexpr (plain_serialized<T, serialized>()) {
+			block_size_t n = std::min(in_items, std::max<block_size_t>(1, out_limit / sizeof(T)));
+			if (out) memcpy(out, in, n * sizeof(T));
+			*out_size = n * sizeof(T);
+			return n;
+		} else if constexpr (serialized) {
+			if (!out) {
+				struct Counter {
+					block_size_t s = 0;
+					void write(const char *, size_t size) {
+						s += size;
+					}
+				};
+				Counter c;
+				block_size_t i = 0;
+				while (i < in_items && c.s < out_limit) serialize(c, items[i++]);
+				*out_size = c.s;
+				return i;
+			}
+
+			struct W {
+				char * o;
+				block_size_t s = 0;
+				void write(const char * data, size_t size) {
+					memcpy(o + s, data, size);
+					s += size;
+				}
+				W(char * o) : o(o) {}
+			};
+			W w(out);
+			block_size_t i = 0;
+			while (i < in_items && w.s < out_limit) serialize(w, items[i++]);
+			*out_size = w.s;
+			return i;
+		} else {
+			unused(items);
+			unused(out);
+			unused(out_limit);
+			*out_size = in_items * sizeof(T);
+			return in_items;
+		}
+	}
+
+	static void unserialize_items(const char * in, block_size_t in_items, char * out) {
+		if constexpr (plain_serialized<T, serialized>()) {
+			memcpy(out, in, in_items * sizeof(T));
+		} else if constexpr (serialized) {
+			struct R {
+				const char * i;
+				block_size_t s = 0;
+				void read(char * data, size_t size) {
+					memcpy(data, i + s, size);
+					s += size;
+				}
+				R(const char * i) : i(i) {}
+			};
+			R r(in);
+			for (block_size_t i = 0; i < in_items; i++) {
+				T * o = new(out + i * sizeof(T)) T;
+				unserialize(r, *o);
+			}
+		} else {
+			unused(in);
+			unused(in_items);
+			unused(out);
+		}
+	}
+
+	static void destruct_items(char * data, block_size_t items) {
+		if constexpr (serialized && !std::is_trivially_destructible<T>::value) {
+			for (block_size_t i = 0; i < items; ++i)
+				reinterpret_cast<T *>(data)[i].~T();
+		} else {
+			unused(data);
+			unused(items);
+		}
+	}
+
+	static constexpr item_codec codec = {
+		serialized, plain_serialized<T, serialized>(), std::is_integral<T>::value, sizeof(T),
+		&serialize_items, &unserialize_items, &destruct_items,
+	};
 };
 
 template <typename T, bool serialized>
@@ -249,6 +599,18 @@ public:
 		return reinterpret_cast<const T *>(m_block->m_data)[m_cur_index];
 	}
 
+	// Reads at most n items from the current block without copying them.
+	// Returns a pointer to the items and sets n to the number of items read, which is at least one.
+	// The items stay valid until the stream moves to another block.
+	const T * read_batch(size_t & n) {
+		assert(m_file_base->is_open() && m_file_base->is_readable() && can_read() && n > 0);
+		if (m_cur_index == m_block->m_logical_size) next_block();
+		n = std::min<size_t>(n, m_block->m_logical_size - m_cur_index);
+		const T * items = reinterpret_cast<const T *>(m_block->m_data) + m_cur_index;
+		m_cur_index += n;
+		return items;
+	}
+
 	const T & read_back() {
 		assert(m_file_base->is_open() && m_file_base->is_readable() && can_read_back());
 		if (m_cur_index == 0) prev_block();
@@ -268,30 +630,59 @@ public:
 		assert(m_file_base->is_open() && m_file_base->is_writable());
 		if (m_cur_index == m_block->m_maximal_logical_size) next_block();
 
-		if constexpr (serialized) {
-			struct Counter {
-				block_size_t s = 0;
-				void write(const char *, size_t size) {
-					s += size;
-				}
-			};
-			Counter c;
-			serialize(c, item);
-			if (this->m_block->m_serialized_size + c.s > max_serialized_block_size()) serialize_block_overflow(c.s);
-			this->m_block->m_serialized_size += c.s;
-
+		if constexpr (plain_serialized<T, serialized>()) {
+			// A full block of plain items always fits in max_serialized_block_size()
+			this->m_block->m_serialized_size += sizeof(T);
+		} else if constexpr (serialized) {
+			if (m_stage_serialized && m_block->m_staged_items == m_cur_index) {
+				// Serialize straight into the staged bytes, there is room for
+				// an item of max_serialized_block_size() after the end of the block.
+				// Bigger items are only counted, as they make serialize_block_overflow throw.
+				struct W {
+					char * o;
+					block_size_t s = 0;
+					void write(const char * data, size_t size) {
+						if (s + size <= max_serialized_block_size()) memcpy(o + s, data, size);
+						s += size;
+					}
+					W(char * o) : o(o) {}
+				};
+				W w(m_block->m_staged + m_block->m_serialized_size);
+				serialize(w, item);
+				if (this->m_block->m_serialized_size + w.s > max_serialized_block_size()) stage_overflow(w.s);
+				stage_item(w.s);
+			} else {
+				struct Counter {
+					block_size_t s = 0;
+					void write(const char *, size_t size) {
+						s += size;
+					}
+				};
+				Counter c;
+				serialize(c, item);
+				if (this->m_block->m_serialized_size + c.s > max_serialized_block_size()) serialize_block_overflow(c.s);
+				this->m_block->m_serialized_size += c.s;
+			}
 		}
 
 		assert(m_file_base->direct() || get_last_block() == m_block);
 		assert(m_file_base->direct() || m_block->m_logical_size == m_cur_index);
 
+		if constexpr (!serialized) {
+			// Only items of direct files are overwritten, see partial_write.
+			// Appending changes the size of the block, so it is written in full anyway
+			if (m_cur_index < m_block->m_logical_size) {
+				m_block->m_dirty_first = std::min(m_block->m_dirty_first, m_cur_index);
+				m_block->m_dirty_last = std::max(m_block->m_dirty_last, m_cur_index + 1);
+			}
+		}
 		new (&reinterpret_cast<T*>(m_block->m_data)[m_cur_index++]) T(std::move(item));
 		m_block->m_logical_size = std::max(m_block->m_logical_size, m_cur_index); //Hopefully this is a cmove
 		m_block->m_dirty = true;
 	}
 
-	void write(T * items, size_t n) {
-		if constexpr (serialized) {
+	void write(const T * items, size_t n) {
+		if constexpr (serialized && !plain_serialized<T, serialized>()) {
 			for (size_t i = 0; i < n; i++)
 				write(items[i]);
 		} else {
@@ -301,7 +692,15 @@ public:
 				if (this->m_cur_index == this->m_block->m_maximal_logical_size) this->next_block();
 				block_size_t remaining = static_cast<block_size_t>(
 					std::min<size_t>(this->m_block->m_maximal_logical_size - this->m_cur_index, n - written));
+				if constexpr (serialized) {
+					assert(get_last_block() == m_block && m_block->m_logical_size == m_cur_index);
+					this->m_block->m_serialized_size += remaining * sizeof(T);
+				}
 				memcpy(this->m_block->m_data + this->m_cur_index * sizeof(T), items + written, remaining * sizeof(T));
+				if (!serialized && this->m_cur_index < this->m_block->m_logical_size) {
+					this->m_block->m_dirty_first = std::min(this->m_block->m_dirty_first, this->m_cur_index);
+					this->m_block->m_dirty_last = std::max(this->m_block->m_dirty_last, this->m_cur_index + remaining);
+				}
 				this->m_cur_index += remaining;
 				this->m_block->m_logical_size = std::max(this->m_block->m_logical_size, this->m_cur_index); //Hopefully this is a cmove
 				this->m_block->m_dirty = true;
@@ -318,7 +717,18 @@ class file_base final: public file_base_base {
 
 public:
 	stream_base<T, serialized> stream() {return stream_base<T, serialized>(this);}
-	file_base(): file_base_base(serialized, sizeof(T)) {}
+
+	// Starts reading the block at p in the background and returns a handle to it.
+	// If given, on_ready is called once the block has been read, either on a job thread
+	// or right away if the block is already in memory. It must not wait for the file or its future.
+	// wait and reset on the future, and so close, wait until on_ready has returned.
+	block_future<T, serialized> read_async(stream_position p, std::function<void()> on_ready = nullptr) {
+		block_future<T, serialized> f;
+		file_base_base::read_async(f, p, std::move(on_ready));
+		return f;
+	}
+
+	file_base(): file_base_base(&item_codec_for<T, serialized>::codec) {}
 	file_base(const file_base &) = delete;
 	file_base & operator=(const file_base &) = delete;
 	file_base(file_base &&) = default;
@@ -330,64 +740,6 @@ public:
 		if (is_open())
 			close();
 	}
-
-	void do_serialize(const char * in, block_size_t in_items, char * out, block_size_t * out_size) override {
-		if constexpr (serialized) {
-			struct W {
-				char * o;
-				block_size_t s = 0;
-				void write(const char * data, size_t size) {
-					if(o) memcpy(o + s, data, size);
-					s += size;
-				}
-				W(char * o) : o(o) {}
-			};
-			W w(out);
-			for (size_t i = 0; i < in_items; i++)
-				serialize(w, reinterpret_cast<const T*>(in)[i]);
-			*out_size = w.s;
-		} else {
-			unused(in);
-			unused(in_items);
-			unused(out);
-			unused(out_size);
-		}
-	}
-
-	void do_unserialize(const char * in, block_size_t in_items, char * out, block_size_t * out_size) override {
-		if constexpr (serialized) {
-			struct R {
-				const char * i;
-				block_size_t s = 0;
-				void read(char * data, size_t size) {
-					memcpy(data, i + s, size);
-					s += size;
-				}
-				R(const char * i) : i(i) {}
-			};
-			R r(in);
-			for (size_t i = 0; i < in_items; i++) {
-				T * o = new(out + i * sizeof(T)) T;
-				unserialize(r, *o);
-			}
-			*out_size = sizeof(T) * in_items;
-		} else {
-			unused(in);
-			unused(in_items);
-			unused(out);
-			unused(out_size);
-		}
-	}
-	
-	void do_destruct(char * data, block_size_t size) override {
-		if constexpr (serialized) {
-			for (size_t i=0; i < size; ++i)
-				reinterpret_cast<T *>(data)[i].~T();
-		} else {
-			unused(data);
-			unused(size);			
-		}
-	}
 };
 
 template <typename T, bool serialized>
@@ -426,6 +778,9 @@ public:
 	template <typename TT>
 	void write_user_data(const TT & data) {m_file.write_user_data(data);}
 	file_size_t size() const noexcept {return m_file.size();}
+	void prefetch(file_size_t offset, file_size_t count) {m_file.prefetch(offset, count);}
+	void drop(file_size_t offset, file_size_t count) {m_file.drop(offset, count);}
+	void advise(access_pattern pattern) {m_file.advise(pattern); m_stream->advise(pattern);}
 
 	// == stream_base_base functions ==
 	bool can_read() const noexcept {return m_stream->can_read();}
@@ -436,14 +791,16 @@ public:
 	file_size_t offset() const noexcept {return m_stream->offset();}
 	stream_position get_position() {return m_stream->get_position();}
 	void set_position(stream_position p) {m_stream->set_position(p);}
+	void prefetch(stream_position p) {m_stream->prefetch(p);}
 
 	// == stream_base functions ==
 	const T & read() {return m_stream->read();}
 	const T & peek() {return m_stream->peek();}
+	const T * read_batch(size_t & n) {return m_stream->read_batch(n);}
 	const T & read_back() {return m_stream->read_back();}
 	const T & peek_back() {return m_stream->peek_back();}
 	void write(T item) {m_stream->write(item);}
-	void write(T * items, size_t n) {m_stream->write(items, n);}
+	void write(const T * items, size_t n) {m_stream->write(items, n);}
 
 private:
 	file_base<T, serialized> m_file;
@@ -3,12 +3,14 @@
 #pragma once
 #include <log.h>
 #include <file_stream.h>
+#include <exception.h>
 #include <mutex>
 #include <condition_variable>
 #include <limits>
 #include <map>
-#include <queue>
+#include <deque>
 #include <unordered_set>
+#include <vector>
 #include <functional>
 #include <atomic>
 
@@ -34,23 +36,71 @@ bool is_known(const std::atomic<T> & val) {
 }
 
 class block;
-void create_available_block(lock_t & l);
-block * pop_available_block(lock_t & l);
+class file_impl;
+struct job;
+// Blocks added to the pool for a file are guaranteed to it, see available_blocks.cpp
+void create_available_block(lock_t & l, file_impl * owner = nullptr);
+block * pop_available_block(lock_t & l, file_impl * file = nullptr);
 void make_block_unavailable(lock_t & l, block * b);
-void destroy_available_block(lock_t & l);
+void destroy_available_block(lock_t & l, file_impl * owner = nullptr);
 void push_available_block(lock_t & l, block * b);
 
+// Blocks shared by the read only files opened on the same file, see block_cache.cpp.
+// A block in shared_file is the one files may take over, and it stays cached when its file is closed.
+struct shared_file;
+// Returns the shared_file for the file open as fd, or nullptr if it can't be identified
+shared_file * open_shared_file(lock_t & l, int fd, const item_codec * codec);
+void close_shared_file(lock_t & l, shared_file * f);
+// Lets other files take over b, unless they already share a block for the same part of the file
+void share_block(lock_t & l, shared_file * f, block * b);
+void unshare_block(lock_t & l, block * b);
+// Moves the shared block idx to file, if there is one that is not in use
+block * take_shared_block(lock_t & l, shared_file * f, file_impl * file, block_idx_t idx);
+// Keeps the shared block b in the pool when its file is closed
+void keep_shared_block(lock_t & l, block * b);
+// Releases a block kept by keep_shared_block that is being repurposed
+void drop_shared_block(lock_t & l, block * b);
+// Removes the blocks added to the pool for caching, when the library is shut down
+void destroy_shared_cache(lock_t & l);
+
+// The state shared by an io_future and the file it waits for, protected by the global mutex
+struct io_state {
+	bool m_done = false;
+	// errno of a failed sync, which io_future::wait throws
+	int m_error = 0;
+};
+
+// The header is written when the file is closed, and as a checkpoint while blocks are written.
+// Blocks past the ones it counts were written after the last checkpoint, and are
+// ignored by readers and cut off when the file is opened for writing.
+// Nothing orders a checkpoint against the blocks it counts reaching the disk, so it only
+// survives the process crashing, except the one written by a sync once its blocks are durable.
 struct file_header {
 	static const uint64_t magicConst = 0x454c494645495054ull;
-	static const uint64_t versionConst = 0;
+	static const uint64_t versionConst = 3;
 
 	uint64_t magic;
 	uint64_t version;
 	block_idx_t blocks;
+	// Physical offset of the last block, if there are any
+	file_size_t last_block_offset;
 	size_t user_data_size;
 	size_t max_user_data_size;
 	bool isCompressed : 1;
 	bool isSerialized : 1;
+	bool isIntegerCoded : 1;
+	bool isShuffled : 1;
+	bool hasChecksums : 1;
+};
+
+// The payload of a compressed block is split into chunks of whole items,
+// which are compressed separately so they can be decompressed (and unserialized)
+// one at a time while they are in cache, or by several threads at once.
+// The compressed chunks are followed by a chunk_header for each of them
+// and finally the number of chunks as an uint32_t.
+struct chunk_header {
+	block_size_t compressed_size;
+	block_size_t items;
 };
 
 /**
@@ -68,10 +118,43 @@ public:
 	uint32_t m_readahead_usage;
 	bool m_done_reading;
 	bool m_io; // false = owned by main thread, true = owned by job thread
+	// The block was read, but its checksum did not match, see open_flags::checksum
+	bool m_checksum_error;
+
+	// Set when other files opened on the same file may take over the block, see share_block
+	shared_file * m_shared;
+
+	// Called by the job thread when the block has been read
+	std::vector<std::function<void()>> m_read_callbacks;
+	// Number of callbacks given to read_async for the block that have not returned yet.
+	// Block futures wait for them, so they don't run after wait or reset have returned.
+	size_t m_callbacks;
 
 	block_size_t m_prev_physical_size, m_physical_size, m_next_physical_size;
 	std::atomic<file_size_t> m_physical_offset;
 
+	// The logical size of the copy of the block on disk, or no_block_size if there is none.
+	// Blocks of direct files of the same size on disk only write their dirty items, see partial_write.
+	block_size_t m_disk_logical_size;
+
+	void clear_dirty_range() {
+		m_dirty_first = no_block_size;
+		m_dirty_last = 0;
+	}
+
+	void allocate_staged() {
+		if (!m_staged) m_staged = new char[staged_buffer_size()] + 2 * sizeof(block_header);
+	}
+
+	void free_staged() {
+		if (m_staged) delete[] (m_staged - 2 * sizeof(block_header));
+		m_staged = nullptr;
+	}
+
+	~block() {
+		free_staged();
+	}
+
 	friend std::ostream & operator << (std::ostream & o, const block & b) {
 		o << "b(" << b.m_idx << "; block: " << b.m_block << "; usage: " << b.m_usage << "; io: " << b.m_io;
 		if (b.m_physical_offset == 0) o << "*";
@@ -90,7 +173,7 @@ public:
 #ifndef NDEBUG
 	size_t m_file_id;
 
-	static size_t file_ctr;
+	static std::atomic<size_t> file_ctr;
 #endif
 
 	// Either m_last_block is null and m_end_position is the end position
@@ -104,26 +187,103 @@ public:
 	// We can only close a file when the job count is 0.
 	uint32_t m_job_count;
 
+	// The serialization functions for the item type of the file
+	const item_codec * m_codec;
 	block_size_t m_item_size;
 	std::map<block_idx_t, block *> m_block_map;
 
 	bool m_serialized;
+	// Items are serialized as their bytes, see plain_items
+	bool m_trivially_serializable;
 	bool m_compressed;
+	// Compressed blocks use integer_compress instead of snappy
+	bool m_integer_codec;
+	// Chunks are byte shuffled before they are compressed
+	bool m_shuffle;
+	// Block headers hold checksums that are verified when blocks are read
+	bool m_checksum;
 
 	bool m_readahead;
+	bool m_stage_serialized;
+	access_pattern m_advice;
+
+	// Blocks read ahead by file level prefetching, oldest first.
+	// m_prefetch_window is the number of blocks the file has added to the pool for them.
+	std::deque<block *> m_prefetch_blocks;
+	size_t m_prefetch_window;
+
+	// Number of block futures holding blocks of this file
+	size_t m_futures;
+
+	// Blocks added to the pool for the streams, futures and prefetching of this file,
+	// and blocks of this file that are not in the pool
+	size_t m_pool_blocks;
+	size_t m_used_blocks;
 
 	bool m_readonly;
+	// Identity of a read only file, whose blocks are shared with other files opened on it
+	shared_file * m_shared;
+	// Anonymous file that is gone when closed, see open_flags::temporary.
+	// The header is kept in memory only.
+	bool m_temporary;
+	// The file is a memfd, see open_flags::in_memory. m_memory_size is its size as counted
+	// against max_in_memory_bytes(), and m_spill is set when it should be moved to disk.
+	// The job threads use m_fd without the lock, so from then on new jobs of the file wait
+	// in m_held_jobs, and the last job to finish moves it, see spill.
+	bool m_in_memory;
+	bool m_spill;
+	std::vector<job> m_held_jobs;
+	file_size_t m_memory_size;
+	// The size of read only files, which reader threads can read without the lock
+	file_size_t m_read_only_size;
 	file_header m_header;
 
+	// Blocks before m_committed_blocks have been written, the last of them at m_committed_offset.
+	// Blocks written out of order wait in m_written_offsets until the blocks before them are written.
+	block_idx_t m_committed_blocks;
+	file_size_t m_committed_offset;
+	std::map<block_idx_t, file_size_t> m_written_offsets;
+	// Number of blocks in the header on disk
+	block_idx_t m_checkpoint_blocks;
+	// The header is written without the lock by one thread at a time, see write_checkpoint
+	bool m_writing_checkpoint;
+
+	// Disk space is allocated up to m_allocated_end, which write jobs move m_preallocation
+	// bytes past the blocks they write at the end. Both are used by job threads without the lock.
+	std::atomic<file_size_t> m_allocated_end;
+	std::atomic<file_size_t> m_preallocation;
+	// The preallocation of a file in memory once it is moved to disk
+	file_size_t m_disk_preallocation;
+
 	std::unordered_set<stream_impl *> m_streams;
 
+	// Flushes waiting for the jobs of the file to be done, see file_base_base::flush_async
+	std::vector<std::shared_ptr<io_state>> m_flushes;
+	// Set by file_base_base::close_async. The file is no longer owned by a file_base_base,
+	// and it is closed and deleted when its last job is done.
+	std::shared_ptr<io_state> m_close;
+	// Syncs waiting for the jobs of the file to be done, see file_base_base::sync_async
+	std::vector<std::shared_ptr<io_state>> m_syncs;
+	// errno of the first failed fdatasync. The kernel may drop the pages that failed to be written,
+	// so later syncs of the file fail too instead of reporting data as durable that is not.
+	int m_sync_error;
+	// A sync of the file is queued or running. It writes the checkpoint itself once the blocks
+	// are durable, and checkpoints are not written meanwhile, so it doesn't make one durable early.
+	bool m_sync_running;
+
 
-	file_impl(file_base_base * outer, bool serialized, block_size_t item_size);
+	file_impl(file_base_base * outer, const item_codec * codec);
 
 	bool direct() const {
 		return !m_compressed && !m_serialized;
 	}
 
+	// Whether the items are stored in the file as they are in memory,
+	// so they can be read and written without serializing them
+	bool plain_items() const {
+		return !m_serialized || m_trivially_serializable;
+	}
+
 	// Note: if you want to keep this block alive after unlocking the lock,
 	// you have to increment its m_usage
 	block * get_available_block(lock_t &, block_idx_t block) const {
@@ -136,7 +296,7 @@ public:
 	block * get_block(lock_t & lock, stream_position p, bool find_next = true, block * rel = nullptr, bool wait = true);
 
 	stream_position start_position() const noexcept {
-		return stream_position{0, 0, 0, sizeof(file_header) + m_outer->max_user_data_size()};
+		return stream_position{0, 0, 0, sizeof(file_header) + m_header.max_user_data_size};
 	}
 
 	void block_ref_inc(lock_t & l, block * b) const noexcept {
@@ -183,18 +343,60 @@ public:
 	block * get_predecessor_block(lock_t & lock, block * block, bool wait = true);
 	void free_readahead_block(lock_t & lock, block * block);
 	void free_block(lock_t & lock, block * block);
+	void prefetch(lock_t & lock, stream_position p);
+	void free_prefetch_blocks(lock_t & lock);
 	void kill_block(lock_t & lock, block * block);
 
+	// Called when the job thread has written block at physical_offset.
+	// Writes a header checkpoint if checkpoint_blocks() more blocks have been committed.
+	void commit_block(lock_t & lock, block_idx_t block, file_size_t physical_offset);
+	// Forgets the blocks from the first not kept, when the file is truncated to truncate_size
+	void uncommit_blocks(lock_t & lock, block_idx_t kept_blocks, file_size_t truncate_size);
+	// Writes the header counting the first blocks, the last of them at offset.
+	// The lock is released while the header is written.
+	void write_checkpoint(lock_t & lock, block_idx_t blocks, file_size_t offset);
+	void write_checkpoint(lock_t & lock) {write_checkpoint(lock, m_committed_blocks, m_committed_offset);}
+
+	// Makes sure disk space is allocated up to end, allocating ahead bytes more if it is not
+	void preallocate(file_size_t end, file_size_t ahead);
+	// Releases the space allocated past size, the size of the file on disk, when the file is closed
+	void trim_preallocation(file_size_t size);
+
+	// Called when the size of a file in memory changes, and decides if it should be moved to disk
+	void memory_size_changed(lock_t & lock, file_size_t size);
+	// Moves a file in memory to a temporary file, keeping the descriptor number.
+	// Called when the only jobs of the file are the held ones, and copies the file without the lock.
+	void spill(lock_t & lock);
+	// Queues a read or write job of the file for the job threads
+	void queue_job(lock_t & lock, const job & j);
+
+	// Called when count jobs of the file are done. When the file has no more jobs,
+	// the waiting flushes are finished, and a file closed by close_async is closed and deleted.
+	void job_done(lock_t & lock, uint32_t count = 1);
+	void finish_flushes(lock_t & lock);
+	// Writes the header and hands the waiting syncs to the group commit, see queue_sync
+	void start_syncs(lock_t & lock);
+	// Releases the blocks of the file, which has no jobs, streams or futures, and closes it
+	void finish_close(lock_t & lock);
+
+	// The exception thrown when a block that failed its checksum is used
+	exception checksum_error(const block * block) const;
+
 	void update_related_physical_sizes(lock_t & l, block * b);
 
 	void do_serialize(const char * in, block_size_t in_items, char * out, block_size_t * out_size) {
 		assert(m_serialized);
-		m_outer->do_serialize(in, in_items, out, out_size);
+		m_codec->serialize(in, in_items, out, std::numeric_limits<block_size_t>::max(), out_size);
 	}
 
 	void do_unserialize(const char * in, block_size_t in_items, char * out, block_size_t * out_size) {
 		assert(m_serialized);
-		m_outer->do_unserialize(in, in_items, out, out_size);
+		m_codec->unserialize(in, in_items, out);
+		*out_size = in_items * m_item_size;
+	}
+
+	void do_destruct(char * data, block_size_t items) {
+		m_codec->destruct(data, items);
 	}
 };
 
@@ -204,9 +406,14 @@ public:
 	file_impl * m_file;
 	block * m_cur_block;
 	block * m_readahead_block;
+	access_pattern m_advice;
+	// Whether this stream has added a block to the pool for m_readahead_block
+	bool m_readahead_slot;
 
 	~stream_impl();
 
+	bool readahead(bool forward) const;
+	void prefetch(lock_t & l, stream_position p);
 	void next_block();
 	void prev_block();
 	void seek(file_size_t offset, whence w);
@@ -214,23 +421,36 @@ public:
 };
 
 enum class job_type {
-	term, write, read, trunc
+	term, write, read, trunc, decompress, sync
 };
 
+struct chunk_work;
+struct sync_work;
+
 struct job {
 	job_type type;
 	file_impl * file;
 	union {
 		block * io_block;
 		file_size_t truncate_size;
+		// Chunks of a block being read, that idle job threads help decompress
+		chunk_work * work;
+		// Files of a group commit that idle job threads help sync, null for the sync job itself
+		sync_work * sync;
 	};
 };
 
+// Allocates the buffers used to read and write blocks on the calling thread, if it has none
 void init_job_buffers();
 void destroy_job_buffers();
 void process_run();
 
-extern std::queue<job> jobs;
+// Completes states when the data and the header of file are on disk. The file has a job until then.
+// The syncs queued while a job thread waits for the disk are done together by two fdatasyncs of each file,
+// one for the blocks committed so far and one for the checkpoint counting them.
+void queue_sync(lock_t & l, file_impl * file, std::vector<std::shared_ptr<io_state>> states);
+
+extern std::deque<job> jobs;
 extern mutex_t global_mutex;
 extern std::condition_variable global_cond;
 extern block_base void_block;
@@ -36,3 +36,39 @@ ssize_t _pwrite(int fd, const void *buf, size_t count, off_t offset) {
 	} while(i < static_cast<ssize_t>(count));
 	return i;
 }
+
+template <typename F>
+ssize_t _vector_io(F f, const char * name, int fd, struct iovec *iov, int iovcnt, off_t offset) {
+	ssize_t i = 0;
+	while (iovcnt > 0) {
+		ssize_t r = f(fd, iov, iovcnt, offset + i);
+		// EOF
+		if (r == 0) return i;
+		// Error
+		if (r < 0) {
+			perror(name);
+			return r;
+		}
+		i += r;
+
+		// Skip the buffers that are done and continue in the middle of the next one
+		while (iovcnt > 0 && static_cast<size_t>(r) >= iov->iov_len) {
+			r -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = static_cast<char *>(iov->iov_base) + r;
+			iov->iov_len -= r;
+		}
+	}
+	return i;
+}
+
+ssize_t _preadv(int fd, struct iovec *iov, int iovcnt, off_t offset) {
+	return _vector_io(::preadv, "preadv", fd, iov, iovcnt, offset);
+}
+
+ssize_t _pwritev(int fd, struct iovec *iov, int iovcnt, off_t offset) {
+	return _vector_io(::pwritev, "pwritev", fd, iov, iovcnt, offset);
+}
@@ -4,6 +4,11 @@
 
 #pragma once
 #include <unistd.h>
+#include <sys/uio.h>
 
 ssize_t _pread(int fd, void *buf, size_t count, off_t offset);
 ssize_t _pwrite(int fd, const void *buf, size_t count, off_t offset);
+
+// Note: these modify iov when only part of the data is transferred in one call
+ssize_t _preadv(int fd, struct iovec *iov, int iovcnt, off_t offset);
+ssize_t _pwritev(int fd, struct iovec *iov, int iovcnt, off_t offset);
@@ -0,0 +1,214 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+#include <integer_codec.h>
+#include <exception.h>
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <string.h>
+
+namespace {
+
+// Packs the low bits bits of the n values into (n * bits + 7) / 8 bytes
+size_t pack(const uint64_t * v, size_t n, unsigned bits, char * out) {
+	if (bits == 0) return 0;
+	char * o = out;
+	uint64_t acc = 0;
+	unsigned fill = 0;
+	for (size_t i = 0; i < n; i++) {
+		acc |= v[i] << fill;
+		if (fill + bits >= 64) {
+			memcpy(o, &acc, sizeof acc);
+			o += sizeof acc;
+			acc = fill? v[i] >> (64 - fill): 0;
+			fill = fill + bits - 64;
+		} else {
+			fill += bits;
+		}
+	}
+	size_t rest = (fill + 7) / 8;
+	memcpy(o, &acc, rest);
+	return o + rest - out;
+}
+
+// Reverses pack and returns the number of bytes read
+size_t unpack(const char * in, size_t n, unsigned bits, uint64_t * v) {
+	if (bits == 0) {
+		std::fill(v, v + n, 0);
+		return 0;
+	}
+	size_t bytes = (n * bits + 7) / 8;
+	const char * p = in;
+	const char * end = in + bytes;
+	uint64_t mask = bits == 64? std::numeric_limits<uint64_t>::max(): (uint64_t(1) << bits) - 1;
+	uint64_t acc = 0;
+	unsigned avail = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (avail >= bits) {
+			v[i] = acc & mask;
+			acc = bits == 64? 0: acc >> bits;
+			avail -= bits;
+		} else {
+			uint64_t w = 0;
+			size_t s = std::min<size_t>(sizeof w, end - p);
+			memcpy(&w, p, s);
+			p += s;
+			v[i] = (acc | (w << avail)) & mask;
+			unsigned used = bits - avail;
+			acc = used == 64? 0: w >> used;
+			avail = 64 - used;
+		}
+	}
+	return bytes;
+}
+
+// Every 8 values of bits bits take bits bytes, so the position of each value of a frame
+// is known at compile time, and it is read with one unaligned load, shift and mask.
+template <unsigned bits, size_t j>
+inline uint64_t unpack_value(const char * group) {
+	constexpr size_t byte = j * bits / 8;
+	constexpr unsigned shift = j * bits % 8;
+	constexpr uint64_t mask = bits == 64? std::numeric_limits<uint64_t>::max(): (uint64_t(1) << bits) - 1;
+	uint64_t w;
+	memcpy(&w, group + byte, sizeof w);
+	uint64_t x = w >> shift;
+	// Values of more than 56 bits may end in the 9th byte
+	if constexpr (shift + bits > 64) x |= uint64_t(static_cast<unsigned char>(group[byte + 8])) << (64 - shift);
+	return x & mask;
+}
+
+template <unsigned bits, size_t... j>
+inline void unpack_group(const char * group, uint64_t * v, std::index_sequence<j...>) {
+	((v[j] = unpack_value<bits, j>(group)), ...);
+}
+
+// Unpacks a full frame of values packed by pack, without branches on the bit width
+template <unsigned bits>
+void unpack_frame(const char * in, uint64_t * v) {
+	constexpr size_t groups = integer_frame_size() / 8;
+	constexpr size_t bytes = groups * bits;
+	// The loads read up to 9 bytes past the start of the last value of a group,
+	// the groups that would read past the frame are unpacked from a padded copy
+	constexpr size_t direct = bytes >= bits + 9? (bytes - bits - 9) / bits + 1: 0;
+	for (size_t g = 0; g < direct; g++)
+		unpack_group<bits>(in + g * bits, v + g * 8, std::make_index_sequence<8>());
+	if constexpr (direct < groups) {
+		char tail[bytes - direct * bits + 16] = {};
+		memcpy(tail, in + direct * bits, bytes - direct * bits);
+		for (size_t g = direct; g < groups; g++)
+			unpack_group<bits>(tail + (g - direct) * bits, v + g * 8, std::make_index_sequence<8>());
+	}
+}
+
+template <>
+void unpack_frame<0>(const char *, uint64_t * v) {
+	std::fill(v, v + integer_frame_size(), 0);
+}
+
+typedef void (*unpack_frame_t)(const char *, uint64_t *);
+
+template <size_t... bits>
+constexpr std::array<unpack_frame_t, sizeof...(bits)> unpack_frame_table(std::index_sequence<bits...>) {
+	return {{&unpack_frame<bits>...}};
+}
+
+// The frame unpacker of each bit width from 0 to 64
+constexpr auto unpack_frames = unpack_frame_table(std::make_index_sequence<65>());
+
+template <typename U>
+size_t compress(const U * in, size_t n, char * out) {
+	typedef typename std::make_signed<U>::type S;
+	if (n == 0) return 0;
+
+	char * o = out;
+	memcpy(o, in, sizeof(U));
+	o += sizeof(U);
+
+	int64_t d[integer_frame_size()];
+	uint64_t packed[integer_frame_size()];
+	for (size_t f = 1; f < n; f += integer_frame_size()) {
+		size_t m = std::min(integer_frame_size(), n - f);
+
+		// The differences wrap around like the items, so they fit in the item width
+		int64_t lo = std::numeric_limits<int64_t>::max();
+		for (size_t i = 0; i < m; i++) {
+			d[i] = S(U(in[f + i] - in[f + i - 1]));
+			lo = std::min(lo, d[i]);
+		}
+
+		uint64_t hi = 0;
+		for (size_t i = 0; i < m; i++) {
+			packed[i] = uint64_t(d[i]) - uint64_t(lo);
+			hi |= packed[i];
+		}
+		unsigned bits = hi? 64 - __builtin_clzll(hi): 0;
+
+		*o++ = char(bits);
+		memcpy(o, &lo, sizeof lo);
+		o += sizeof lo;
+		o += pack(packed, m, bits, o);
+	}
+	return o - out;
+}
+
+template <typename U>
+void uncompress(const char * in, size_t n, U * out) {
+	if (n == 0) return;
+
+	const char * p = in;
+	U prev;
+	memcpy(&prev, p, sizeof(U));
+	p += sizeof(U);
+	out[0] = prev;
+
+	uint64_t packed[integer_frame_size()];
+	for (size_t f = 1; f < n; f += integer_frame_size()) {
+		size_t m = std::min(integer_frame_size(), n - f);
+
+		unsigned bits = static_cast<unsigned char>(*p++);
+		assert(bits <= 64);
+		int64_t lo;
+		memcpy(&lo, p, sizeof lo);
+		p += sizeof lo;
+		if (m == integer_frame_size()) {
+			unpack_frames[bits](p, packed);
+			p += integer_frame_size() * bits / 8;
+		} else {
+			p += unpack(p, m, bits, packed);
+		}
+
+		for (size_t i = 0; i < m; i++) {
+			prev = U(prev + U(packed[i] + uint64_t(lo)));
+			out[f + i] = prev;
+		}
+	}
+}
+
+} //namespace
+
+size_t integer_compress(const char * in, size_t items, size_t item_size, char * out) {
+	size_t size;
+	switch (item_size) {
+	case 1: size = compress(reinterpret_cast<const uint8_t *>(in), items, out); break;
+	case 2: size = compress(reinterpret_cast<const uint16_t *>(in), items, out); break;
+	case 4: size = compress(reinterpret_cast<const uint32_t *>(in), items, out); break;
+	case 8: size = compress(reinterpret_cast<const uint64_t *>(in), items, out); break;
+	default: throw exception("Unsupported integer size " + std::to_string(item_size));
+	}
+	assert(size <= integer_max_compressed_length(items, item_size));
+	return size;
+}
+
+void integer_uncompress(const char * in, size_t items, size_t item_size, char * out) {
+	switch (item_size) {
+	case 1: uncompress(in, items, reinterpret_cast<uint8_t *>(out)); break;
+	case 2: uncompress(in, items, reinterpret_cast<uint16_t *>(out)); break;
+	case 4: uncompress(in, items, reinterpret_cast<uint32_t *>(out)); break;
+	case 8: uncompress(in, items, reinterpret_cast<uint64_t *>(out)); break;
+	default: throw exception("Unsupported integer size " + std::to_string(item_size));
+	}
+}
@@ -0,0 +1,36 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+///////////////////////////////////////////////////////////////////////////////
+/// \file integer_codec.h  Delta and bit packing compression of integers
+///
+/// Used instead of snappy for compressed files of integral items opened with
+/// open_flags::integer_codec. The first item is stored as it is, the rest as
+/// the differences between consecutive items. The differences are split in
+/// frames of integer_frame_size() items, and each frame stores its smallest
+/// difference followed by the differences minus it, bit packed with the
+/// number of bits needed for the largest of them. Sorted keys with a fixed
+/// gap take no bits at all.
+///////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+constexpr size_t integer_frame_size() {return 128;}
+
+// Size of the frame header, the number of bits and the smallest difference
+constexpr size_t integer_frame_header_size() {return 1 + sizeof(int64_t);}
+
+// Upper bound on the compressed size of items integers of item_size bytes
+constexpr size_t integer_max_compressed_length(size_t items, size_t item_size) {
+	return item_size + (items + integer_frame_size() - 1) / integer_frame_size() * integer_frame_header_size()
+		+ items * item_size;
+}
+
+// Compresses items integers of item_size bytes (1, 2, 4 or 8) from in to out
+// and returns the compressed size
+size_t integer_compress(const char * in, size_t items, size_t item_size, char * out);
+
+// Decompresses items integers of item_size bytes compressed by integer_compress
+void integer_uncompress(const char * in, size_t items, size_t item_size, char * out);
@@ -2,12 +2,19 @@
 // vi:set ts=4 sts=4 sw=4 noet :
 #include <file_utils.h>
 #include <file_stream_impl.h>
+#include <integer_codec.h>
+#include <shuffle.h>
+#include <crc32c.h>
+#include <algorithm>
 #include <cassert>
 #include <snappy.h>
 #include <atomic>
+#include <cstddef>
+#include <cerrno>
+#include <cstring>
 
 #ifndef NDEBUG
-std::atomic_int64_t total_blocks_read, total_blocks_written, total_bytes_read, total_bytes_written;
+std::atomic_int64_t total_blocks_read, total_blocks_written, total_bytes_read, total_bytes_written, total_write_calls, total_helped_chunks;
 int64_t get_total_blocks_read() {
 	return total_blocks_read;
 }
@@ -20,10 +27,18 @@ int64_t get_total_bytes_read() {
 int64_t get_total_bytes_written() {
 	return total_bytes_written;
 }
+// Calls writing blocks or parts of them to disk
+int64_t get_total_write_calls() {
+	return total_write_calls;
+}
+// Chunks decompressed by job threads helping the thread reading their block
+int64_t get_total_helped_chunks() {
+	return total_helped_chunks;
+}
 std::map<size_t, std::map<block_idx_t, std::pair<file_size_t, file_size_t>>> block_offsets;
 #endif
 
-std::queue<job> jobs;
+std::deque<job> jobs;
 mutex_t global_mutex;
 cond_t global_cond;
 
@@ -44,12 +59,22 @@ std::ostream & operator <<(std::ostream & o, const job_type t) {
 	case job_type::term:
 		s = "term";
 		break;
+	case job_type::decompress:
+		s = "decompress";
+		break;
+	case job_type::sync:
+		s = "sync";
+		break;
 	}
 	return o << s;
 }
 
 const size_t extra_before_buffer = 2 * sizeof(block_header);
-const size_t max_buffer_size = snappy::MaxCompressedLength(max_serialized_block_size()) + 2 * sizeof(block_header);
+// Maximum number of adjacent blocks read or written by a single call
+const size_t max_coalesced_blocks = 16;
+const size_t max_buffer_size = snappy::MaxCompressedLength(max_serialized_block_size())
+	+ max_compression_chunks() * (snappy::MaxCompressedLength(0) + sizeof(chunk_header)) + sizeof(uint32_t)
+	+ 2 * sizeof(block_header);
 
 thread_local auto id = tid.fetch_add(1);
 thread_local char * _data1 = nullptr;
@@ -57,7 +82,17 @@ thread_local char * _data2 = nullptr;
 thread_local char * buffer1 = nullptr;
 thread_local char * buffer2 = nullptr;
 
+// Frees the buffers when the thread exits,
+// for user threads that got them to read blocks themselves
+struct job_buffers_owner {
+	~job_buffers_owner() {destroy_job_buffers();}
+};
+
 void init_job_buffers() {
+	if (_data1) return;
+	thread_local job_buffers_owner owner;
+	unused(owner);
+
 	_data1 = new char[extra_before_buffer + max_buffer_size];
 	_data2 = new char[extra_before_buffer + max_buffer_size];
 
@@ -68,6 +103,392 @@ void init_job_buffers() {
 void destroy_job_buffers() {
 	delete[] _data1;
 	delete[] _data2;
+	_data1 = _data2 = buffer1 = buffer2 = nullptr;
+}
+
+// How the chunks of a file are encoded. compress_chunks and decompress_chunk are
+// instantiated for each, and the encoding is picked once per block, so the steps
+// of a chunk are inlined into one loop. Only the serialization of items that are
+// not their bytes calls the item_codec of the file.
+enum class chunk_codec {
+	snappy,
+	shuffle,
+	integer,
+	serialize
+};
+
+chunk_codec chunk_codec_of(const file_impl * file) {
+	if (!file->plain_items()) return chunk_codec::serialize;
+	if (file->m_integer_codec) return chunk_codec::integer;
+	if (file->m_shuffle) return chunk_codec::shuffle;
+	return chunk_codec::snappy;
+}
+
+// Compresses item_count items in chunks, see chunk_header, and returns the compressed size.
+// Serialized items are serialized into buffer1 one chunk at a time,
+// plain items are compressed directly from items unless they are byte shuffled into buffer1.
+template <chunk_codec codec>
+size_t compress_chunks(file_impl * file, const char * items, block_size_t item_count, char * out, block_size_t * serialized_size) {
+	chunk_header table[max_compression_chunks()];
+	uint32_t chunks = 0;
+	size_t out_size = 0;
+	*serialized_size = 0;
+
+	const size_t item_size = file->m_item_size;
+	block_size_t i = 0;
+	while (i < item_count) {
+		chunk_header c;
+		const char * chunk_data;
+		block_size_t chunk_size = 0;
+		if constexpr (codec == chunk_codec::serialize) {
+			c.items = file->m_codec->serialize(items + i * item_size, item_count - i, buffer1, compression_chunk_size(), &chunk_size);
+			chunk_data = buffer1;
+		} else {
+			c.items = std::min(item_count - i, std::max<block_size_t>(1, compression_chunk_size() / item_size));
+			chunk_size = c.items * item_size;
+			chunk_data = items + i * item_size;
+			if constexpr (codec == chunk_codec::shuffle) {
+				shuffle(chunk_data, c.items, item_size, buffer1);
+				chunk_data = buffer1;
+			}
+		}
+
+		size_t compressed_size;
+		if constexpr (codec == chunk_codec::integer)
+			compressed_size = integer_compress(chunk_data, c.items, item_size, out + out_size);
+		else
+			snappy::RawCompress(chunk_data, chunk_size, out + out_size, &compressed_size);
+		c.compressed_size = static_cast<block_size_t>(compressed_size);
+
+		assert(chunks < max_compression_chunks());
+		table[chunks++] = c;
+		out_size += compressed_size;
+		*serialized_size += chunk_size;
+		i += c.items;
+	}
+
+	memcpy(out + out_size, table, chunks * sizeof(chunk_header));
+	out_size += chunks * sizeof(chunk_header);
+	memcpy(out + out_size, &chunks, sizeof chunks);
+	out_size += sizeof chunks;
+	assert(out_size + 2 * sizeof(block_header) <= max_buffer_size);
+	return out_size;
+}
+
+size_t compress_chunks(file_impl * file, const char * items, block_size_t item_count, char * out, block_size_t * serialized_size) {
+	switch (chunk_codec_of(file)) {
+	case chunk_codec::snappy:
+		return compress_chunks<chunk_codec::snappy>(file, items, item_count, out, serialized_size);
+	case chunk_codec::shuffle:
+		return compress_chunks<chunk_codec::shuffle>(file, items, item_count, out, serialized_size);
+	case chunk_codec::integer:
+		return compress_chunks<chunk_codec::integer>(file, items, item_count, out, serialized_size);
+	case chunk_codec::serialize:
+		break;
+	}
+	return compress_chunks<chunk_codec::serialize>(file, items, item_count, out, serialized_size);
+}
+
+// Compresses the staged bytes of a block using the chunks found while staging,
+// the output is the same as that of compress_chunks.
+size_t compress_staged_chunks(const block * b, block_size_t item_count, block_size_t serialized_size, char * out) {
+	chunk_header table[max_compression_chunks()];
+	uint32_t chunks = 0;
+	size_t out_size = 0;
+
+	block_size_t bytes = 0, items = 0;
+	for (block_size_t i = 0; i <= b->m_staged_chunk_count; i++) {
+		staged_chunk end = i < b->m_staged_chunk_count? b->m_staged_chunks[i]: staged_chunk{serialized_size, item_count};
+		if (end.m_items == items) continue;
+
+		size_t compressed_size;
+		snappy::RawCompress(b->m_staged + bytes, end.m_bytes - bytes, out + out_size, &compressed_size);
+
+		assert(chunks < max_compression_chunks());
+		table[chunks].compressed_size = static_cast<block_size_t>(compressed_size);
+		table[chunks].items = end.m_items - items;
+		chunks++;
+		out_size += compressed_size;
+		bytes = end.m_bytes;
+		items = end.m_items;
+	}
+
+	memcpy(out + out_size, table, chunks * sizeof(chunk_header));
+	out_size += chunks * sizeof(chunk_header);
+	memcpy(out + out_size, &chunks, sizeof chunks);
+	out_size += sizeof chunks;
+	assert(out_size + 2 * sizeof(block_header) <= max_buffer_size);
+	return out_size;
+}
+
+// Decompresses the chunk c from in to the items at item_data and returns its uncompressed size.
+// Chunks of serialized items are decompressed into buffer2 and unserialized from there,
+// plain items are decompressed directly into item_data unless they need to be unshuffled.
+template <chunk_codec codec>
+block_size_t decompress_chunk(file_impl * file, const char * in, chunk_header c, char * item_data) {
+	char * uncompressed_data = codec == chunk_codec::snappy || codec == chunk_codec::integer? item_data: buffer2;
+
+	size_t uncompressed_size = 0;
+	if constexpr (codec == chunk_codec::integer) {
+		uncompressed_size = c.items * file->m_item_size;
+		integer_uncompress(in, c.items, file->m_item_size, uncompressed_data);
+	} else {
+		bool ok = snappy::GetUncompressedLength(in, c.compressed_size, &uncompressed_size);
+		assert(ok && uncompressed_size <= max_buffer_size);
+		ok = snappy::RawUncompress(in, c.compressed_size, uncompressed_data);
+		assert(ok);
+		unused(ok);
+	}
+
+	if constexpr (codec == chunk_codec::serialize) {
+		block_size_t unserialized_size;
+		file->do_unserialize(uncompressed_data, c.items, item_data, &unserialized_size);
+		assert(unserialized_size == c.items * file->m_item_size);
+	} else if constexpr (codec == chunk_codec::shuffle) {
+		unshuffle(uncompressed_data, c.items, file->m_item_size, item_data);
+	}
+	return static_cast<block_size_t>(uncompressed_size);
+}
+
+// The chunks of a block, shared by the thread reading the block and the idle job threads
+// helping it. Every thread takes the next chunk from next_chunk until none are left,
+// so the block is decompressed even if no helper gets to run.
+struct chunk_work {
+	file_impl * file;
+	uint32_t chunks;
+	const char * in[max_compression_chunks()];
+	char * out[max_compression_chunks()];
+	chunk_header header[max_compression_chunks()];
+	std::atomic<uint32_t> next_chunk;
+	std::atomic<block_size_t> serialized_size;
+	// Number of helpers decompressing chunks, protected by the global mutex
+	size_t helpers;
+};
+
+// Number of job threads waiting for jobs, protected by the global mutex
+size_t idle_job_threads = 0;
+
+// Returns the number of chunks decompressed
+template <chunk_codec codec>
+uint32_t decompress_remaining_chunks(chunk_work & w) {
+	block_size_t serialized_size = 0;
+	uint32_t chunks = 0;
+	while (true) {
+		uint32_t i = w.next_chunk.fetch_add(1);
+		if (i >= w.chunks) break;
+		serialized_size += decompress_chunk<codec>(w.file, w.in[i], w.header[i], w.out[i]);
+		chunks++;
+	}
+	w.serialized_size += serialized_size;
+	return chunks;
+}
+
+uint32_t decompress_remaining_chunks(chunk_work & w) {
+	switch (chunk_codec_of(w.file)) {
+	case chunk_codec::snappy: return decompress_remaining_chunks<chunk_codec::snappy>(w);
+	case chunk_codec::shuffle: return decompress_remaining_chunks<chunk_codec::shuffle>(w);
+	case chunk_codec::integer: return decompress_remaining_chunks<chunk_codec::integer>(w);
+	case chunk_codec::serialize: break;
+	}
+	return decompress_remaining_chunks<chunk_codec::serialize>(w);
+}
+
+void execute_decompress_job(lock_t & job_lock, chunk_work * w) {
+	w->helpers++;
+	job_lock.unlock();
+	log_info() << "JOB " << id << " help decompress" << std::endl;
+	uint32_t chunks = decompress_remaining_chunks(*w);
+	unused(chunks);
+#ifndef NDEBUG
+	total_helped_chunks += chunks;
+#endif
+	job_lock.lock();
+	w->helpers--;
+	global_cond.notify_all();
+}
+
+// Decompresses the chunks written by compress_chunks into out and returns the uncompressed size.
+// When there are idle job threads, they are given jobs to decompress some of the chunks.
+// job_lock must not be held.
+block_size_t decompress_chunks(lock_t & job_lock, file_impl * file, const char * in, block_size_t in_size, char * out, block_size_t item_count) {
+	chunk_work w;
+	memcpy(&w.chunks, in + in_size - sizeof w.chunks, sizeof w.chunks);
+	assert(w.chunks <= max_compression_chunks());
+	const char * table = in + in_size - sizeof w.chunks - w.chunks * sizeof(chunk_header);
+	memcpy(w.header, table, w.chunks * sizeof(chunk_header));
+	w.file = file;
+	w.next_chunk = 0;
+	w.serialized_size = 0;
+	w.helpers = 0;
+
+	block_size_t items = 0;
+	for (uint32_t i = 0; i < w.chunks; i++) {
+		w.in[i] = in;
+		w.out[i] = out + items * file->m_item_size;
+		in += w.header[i].compressed_size;
+		items += w.header[i].items;
+	}
+	assert(in == table);
+	assert(items == item_count);
+	unused(item_count);
+
+	size_t helpers = 0;
+	if (w.chunks > 1) {
+		job_lock.lock();
+		helpers = std::min<size_t>(idle_job_threads, w.chunks - 1);
+		for (size_t i = 0; i < helpers; i++) {
+			job j;
+			j.type = job_type::decompress;
+			j.file = file;
+			j.work = &w;
+			jobs.push_front(j);
+		}
+		if (helpers) global_cond.notify_all();
+		job_lock.unlock();
+	}
+
+	decompress_remaining_chunks(w);
+
+	if (helpers) {
+		job_lock.lock();
+		// Helpers that have not started are not needed, and must not see w after we return
+		jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [&w](const job & j) {
+			return j.type == job_type::decompress && j.work == &w;
+		}), jobs.end());
+		while (w.helpers) global_cond.wait(job_lock);
+		job_lock.unlock();
+	}
+	return w.serialized_size;
+}
+
+struct sync_request {
+	file_impl * file;
+	std::vector<std::shared_ptr<io_state>> states;
+	// The checkpoint written once the blocks are durable, the blocks committed when the sync started
+	block_idx_t blocks;
+	file_size_t offset;
+};
+
+// Syncs waiting for the next group commit, and whether a sync job is queued or running,
+// protected by the global mutex
+std::vector<sync_request> sync_requests;
+bool sync_job_queued = false;
+
+void queue_sync(lock_t &, file_impl * file, std::vector<std::shared_ptr<io_state>> states) {
+	sync_requests.push_back(sync_request{file, std::move(states), file->m_committed_blocks, file->m_committed_offset});
+	if (sync_job_queued) return;
+	job j;
+	j.type = job_type::sync;
+	j.file = nullptr;
+	j.sync = nullptr;
+	jobs.push_back(j);
+	sync_job_queued = true;
+	global_cond.notify_all();
+}
+
+// The files of a group commit, shared by the thread running the sync job and the idle job
+// threads helping it. Every thread syncs the next file from next_fd until none are left.
+struct sync_work {
+	std::vector<int> fds;
+	// errno of the fdatasync of each file, or 0
+	std::vector<int> errors;
+	std::atomic<size_t> next_fd;
+	// Number of helpers syncing files, protected by the global mutex
+	size_t helpers;
+};
+
+void sync_remaining_files(sync_work & w) {
+	while (true) {
+		size_t i = w.next_fd.fetch_add(1);
+		if (i >= w.fds.size()) break;
+		if (::fdatasync(w.fds[i]) != 0) w.errors[i] = errno;
+	}
+}
+
+void execute_sync_help_job(lock_t & job_lock, sync_work * w) {
+	w->helpers++;
+	job_lock.unlock();
+	log_info() << "JOB " << id << " help sync" << std::endl;
+	sync_remaining_files(*w);
+	job_lock.lock();
+	w->helpers--;
+	global_cond.notify_all();
+}
+
+// Syncs the files of w, spread over the idle job threads so the round trips to the disk overlap
+void sync_files(lock_t & job_lock, sync_work & w) {
+	w.next_fd = 0;
+	w.helpers = 0;
+
+	size_t helpers = std::min<size_t>(idle_job_threads, w.fds.size() - 1);
+	for (size_t i = 0; i < helpers; i++) {
+		job j;
+		j.type = job_type::sync;
+		j.file = nullptr;
+		j.sync = &w;
+		jobs.push_front(j);
+	}
+	if (helpers) global_cond.notify_all();
+
+	job_lock.unlock();
+	log_info() << "JOB " << id << " sync       " << w.fds.size() << " files" << std::endl;
+	sync_remaining_files(w);
+	job_lock.lock();
+
+	if (helpers) {
+		// Helpers that have not started are not needed, and must not see w after this round
+		jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [&w](const job & j) {
+			return j.type == job_type::sync && j.sync == &w;
+		}), jobs.end());
+		while (w.helpers) global_cond.wait(job_lock);
+	}
+}
+
+// Syncs the files of all waiting requests. The blocks are made durable before the checkpoint
+// counting them is written, and the checkpoint by a second fdatasync, so a header on disk never
+// counts blocks that were lost. Requests queued meanwhile are done by the next round,
+// so a burst of syncs costs a few round trips.
+void execute_sync_job(lock_t & job_lock) {
+	while (!sync_requests.empty()) {
+		std::vector<sync_request> group;
+		group.swap(sync_requests);
+		sync_work w;
+		for (auto & r : group) w.fds.push_back(r.file->m_fd);
+		std::sort(w.fds.begin(), w.fds.end());
+		w.fds.erase(std::unique(w.fds.begin(), w.fds.end()), w.fds.end());
+		w.errors.assign(w.fds.size(), 0);
+		auto fd_index = [&w](const file_impl * file) {
+			return std::lower_bound(w.fds.begin(), w.fds.end(), file->m_fd) - w.fds.begin();
+		};
+
+		log_info() << "JOB " << id << " sync group " << group.size() << " requests" << std::endl;
+		sync_files(job_lock, w);
+		for (auto & r : group) {
+			if (w.errors[fd_index(r.file)] == 0) r.file->write_checkpoint(job_lock, r.blocks, r.offset);
+		}
+		sync_files(job_lock, w);
+
+		for (auto & r : group) {
+			size_t i = fd_index(r.file);
+			r.file->m_sync_running = false;
+			if (w.errors[i] != 0 && r.file->m_sync_error == 0) {
+				log_info() << "JOB " << id << " fdatasync failed for " << r.file->m_path << ": " << std::strerror(w.errors[i]) << std::endl;
+				r.file->m_sync_error = w.errors[i];
+			}
+			for (auto & s : r.states) {
+				s->m_error = r.file->m_sync_error;
+				s->m_done = true;
+			}
+			r.file->job_done(job_lock);
+		}
+		global_cond.notify_all();
+	}
+	sync_job_queued = false;
+}
+
+// The checksum of a block covers the header fields before the checksum and the payload
+uint32_t block_checksum(const block_header & h, const char * payload, size_t size) {
+	return crc32c(payload, size, crc32c(&h, offsetof(block_header, checksum)));
 }
 
 void execute_read_job(lock_t & job_lock, file_impl * file, block * b) {
@@ -86,6 +507,16 @@ void execute_read_job(lock_t & job_lock, file_impl * file, block * b) {
 	assert(is_known(block));
 	assert(is_known(physical_offset));
 
+	char * physical_data;
+	block_size_t max_physical_size;
+	if (!file->m_compressed && file->plain_items()) {
+		physical_data = b->m_data;
+		max_physical_size = block_size() + 2 * sizeof(block_header);
+	} else {
+		physical_data = buffer1;
+		max_physical_size = max_buffer_size;
+	}
+
 	if (!is_known(physical_size)) {
 		block_header h;
 		auto r = _pread(file->m_fd, &h, sizeof(block_header), physical_offset);
@@ -97,101 +528,92 @@ void execute_read_job(lock_t & job_lock, file_impl * file, block * b) {
 		physical_size = h.physical_size;
 	}
 
+	// A damaged header could make us read past the end of the buffer
+	bool checksum_error = file->m_checksum &&
+		(physical_size < 2 * sizeof(block_header) || physical_size > max_physical_size);
+
+	file_size_t logical_offset = b->m_logical_offset;
+	block_size_t logical_size = 0;
+	block_size_t serialized_size = 0;
+	if (!checksum_error) {
+		file_size_t read_off = physical_offset;
+		file_size_t read_size = physical_size;
+		bool read_prev_header = block != 0 && !is_known(prev_physical_size);
+		if (read_prev_header) { // NOT THE FIRST BLOCK
+			read_off -= sizeof(block_header);
+			read_size += sizeof(block_header);
+		}
 
-	file_size_t read_off = physical_offset;
-	file_size_t read_size = physical_size;
-	bool read_prev_header = block != 0 && !is_known(prev_physical_size);
-	if (read_prev_header) { // NOT THE FIRST BLOCK
-		read_off -= sizeof(block_header);
-		read_size += sizeof(block_header);
-	}
-
-	if (read_next_header) {
-		read_size += sizeof(block_header);
-	}
-
-	log_info() << "JOB " << id << " pread      " << *b << " from " << read_off << " - " << (read_off + read_size - 1) << std::endl;
+		if (read_next_header) {
+			read_size += sizeof(block_header);
+		}
 
-	char * physical_data;
-	if (file->direct()) {
-		physical_data = b->m_data;
-	} else {
-		physical_data = buffer1;
-	}
+		log_info() << "JOB " << id << " pread      " << *b << " from " << read_off << " - " << (read_off + read_size - 1) << std::endl;
 
-	physical_data -= (read_prev_header? 2: 1) * sizeof(block_header);
+		physical_data -= (read_prev_header? 2: 1) * sizeof(block_header);
 
-	char * uncompressed_data;
-	if (file->m_compressed && !file->m_serialized) {
-		uncompressed_data = b->m_data;
-	} else {
-		uncompressed_data = buffer2;
-	}
-
-	auto bytes_read = _pread(file->m_fd, physical_data, read_size, read_off);
-	if (read_next_header && bytes_read == static_cast<ssize_t>(read_size) - static_cast<ssize_t>(sizeof(block_header))) {
-		read_next_header = false;
-	} else {
-		assert(bytes_read == static_cast<ssize_t>(read_size));
-	}
+		auto bytes_read = _pread(file->m_fd, physical_data, read_size, read_off);
+		if (read_next_header && bytes_read == static_cast<ssize_t>(read_size) - static_cast<ssize_t>(sizeof(block_header))) {
+			read_next_header = false;
+		} else {
+			assert(bytes_read == static_cast<ssize_t>(read_size));
+		}
 #ifndef NDEBUG
-	total_bytes_read += bytes_read;
+		total_bytes_read += bytes_read;
 #endif
 
-	if (read_prev_header) {
-		//log_info() << id << "read prev header" << std::endl;
-		block_header h;
-		memcpy(&h, physical_data, sizeof(block_header));
-		physical_data += sizeof(block_header);
-		prev_physical_size = h.physical_size;
-	}
+		if (read_prev_header) {
+			//log_info() << id << "read prev header" << std::endl;
+			block_header h;
+			memcpy(&h, physical_data, sizeof(block_header));
+			physical_data += sizeof(block_header);
+			prev_physical_size = h.physical_size;
+		}
 
-	file_size_t logical_offset;
-	block_size_t logical_size;
-	{
 		block_header h;
 		memcpy(&h, physical_data, sizeof(block_header));
 		//log_info() << id << "Read current header " << physical_size << " " << h.physical_size << std::endl;
 
 		physical_data += sizeof(block_header);
-		assert(physical_size == h.physical_size);
-		logical_size = h.logical_size;
-		logical_offset = h.logical_offset;
-	}
-
-	char * compressed_data = physical_data;
-
-	physical_data += physical_size - sizeof(block_header);
-	if (read_next_header) {
-		block_header h;
-		memcpy(&h, physical_data, sizeof(block_header));
-		assert(h.logical_offset == logical_offset + logical_size);
-		physical_data += sizeof(block_header);
-		next_physical_size = h.physical_size;
-	}
-
-	block_size_t compressed_size = physical_size - 2 * sizeof(block_header);
+		char * compressed_data = physical_data;
+		block_size_t compressed_size = physical_size - 2 * sizeof(block_header);
+
+		if (file->m_checksum) {
+			// The header after the payload must be the same, or the block was only partly written
+			checksum_error = h.physical_size != physical_size
+				|| memcmp(&h, compressed_data + compressed_size, sizeof(block_header)) != 0
+				|| h.checksum != block_checksum(h, compressed_data, compressed_size);
+		}
+		assert(checksum_error || physical_size == h.physical_size);
+
+		physical_data += physical_size - sizeof(block_header);
+		if (read_next_header) {
+			block_header nh;
+			memcpy(&nh, physical_data, sizeof(block_header));
+			assert(checksum_error || nh.logical_offset == h.logical_offset + h.logical_size);
+			physical_data += sizeof(block_header);
+			next_physical_size = nh.physical_size;
+		}
 
-	size_t uncompressed_size;
-	if (file->m_compressed) {
-		bool ok = snappy::GetUncompressedLength(compressed_data, compressed_size, &uncompressed_size);
-		assert(ok);
-		unused(ok);
-		assert(uncompressed_size <= max_buffer_size);
-		ok = snappy::RawUncompress(compressed_data, compressed_size, uncompressed_data);
-		assert(ok);
-	} else {
-		uncompressed_data = compressed_data;
-		uncompressed_size = compressed_size;
+		if (!checksum_error) {
+			logical_size = h.logical_size;
+			logical_offset = h.logical_offset;
+
+			if (file->m_compressed) {
+				serialized_size = decompress_chunks(job_lock, file, compressed_data, compressed_size, b->m_data, logical_size);
+			} else {
+				serialized_size = compressed_size;
+				if (!file->plain_items()) {
+					block_size_t unserialized_size;
+					file->do_unserialize(compressed_data, logical_size, b->m_data, &unserialized_size);
+					assert(unserialized_size == logical_size * file->m_item_size);
+				}
+			}
+		}
 	}
 
-	block_size_t serialized_size = uncompressed_size;
-
-	if (file->m_serialized) {
-		block_size_t unserialized_size;
-		file->do_unserialize(uncompressed_data, logical_size, b->m_data, &unserialized_size);
-		assert(unserialized_size == logical_size * file->m_item_size);
-	}
+	if (checksum_error)
+		log_info() << "JOB " << id << " checksum mismatch in " << *b << std::endl;
 
 	log_info() << "Read " << *b << '\n'
 	           << "Logical size " << logical_size << '\n'
@@ -200,37 +622,110 @@ void execute_read_job(lock_t & job_lock, file_impl * file, block * b) {
 
 	job_lock.lock();
 
-	// If the file is serialized and the current block is not
-	// the last one we have to override its maximal_logical_size here
-	// as we can only append
-	if (file->m_serialized && !is_last_block) {
-		b->m_maximal_logical_size = logical_size;
-	}
-
 	b->m_done_reading = true;
 	b->m_io = false;
 
-	b->m_prev_physical_size = prev_physical_size;
-	b->m_next_physical_size = next_physical_size;
-	b->m_logical_size = logical_size;
-	b->m_physical_size = physical_size;
-	b->m_logical_offset = logical_offset;
-	b->m_serialized_size = serialized_size;
+	if (checksum_error) {
+		// The block is left empty, and the error is raised when it is used.
+		// Nothing read from the block can be trusted, so sizes and offsets are not updated.
+		b->m_checksum_error = true;
+		b->m_logical_size = 0;
+		b->m_serialized_size = 0;
+	} else {
+		// If the file is serialized and the current block is not
+		// the last one we have to override its maximal_logical_size here
+		// as we can only append
+		if (file->m_serialized && !is_last_block) {
+			b->m_maximal_logical_size = logical_size;
+		}
 
-	if (is_last_block) {
-		file->m_last_block = b;
+		b->m_prev_physical_size = prev_physical_size;
+		b->m_next_physical_size = next_physical_size;
+		b->m_logical_size = logical_size;
+		b->m_disk_logical_size = logical_size;
+		b->m_physical_size = physical_size;
+		b->m_logical_offset = logical_offset;
+		b->m_serialized_size = serialized_size;
+
+		if (is_last_block) {
+			file->m_last_block = b;
+		}
+
+		file->update_related_physical_sizes(job_lock, b);
 	}
 
-	file->update_related_physical_sizes(job_lock, b);
+	std::vector<std::function<void()>> callbacks;
+	callbacks.swap(b->m_read_callbacks);
 
+	// The futures holding the block wait for the callbacks, so it stays while they run
 	file->free_block(job_lock, b);
 
 #ifndef NDEBUG
 	total_blocks_read++;
 #endif
+
+	if (!callbacks.empty()) {
+		job_lock.unlock();
+		for (auto & c : callbacks) c();
+		job_lock.lock();
+		b->m_callbacks -= callbacks.size();
+		global_cond.notify_all();
+	}
+}
+
+// Blocks of direct files that are on disk with the same size only need the items
+// written since they were read or written. Checksums cover the whole block,
+// so blocks of files with checksums are always written in full.
+bool partial_write(const file_impl * file, const block * b) {
+	return file->direct() && !file->m_checksum && b->m_disk_logical_size == b->m_logical_size;
+}
+
+// Writes the dirty items of a block, see partial_write, rounded out to whole pages
+void execute_partial_write_job(lock_t & job_lock, file_impl * file, block * b) {
+	block_size_t first = b->m_dirty_first * file->m_item_size;
+	block_size_t last = std::min(b->m_dirty_last, b->m_logical_size) * file->m_item_size;
+	block_size_t data_size = b->m_logical_size * file->m_item_size;
+	b->clear_dirty_range();
+	file_size_t data_offset = b->m_physical_offset + sizeof(block_header);
+	assert(is_known(b->m_physical_offset));
+
+	job_lock.unlock();
+
+	if (first < last) {
+		static const file_size_t page_size = static_cast<file_size_t>(sysconf(_SC_PAGESIZE));
+		file_size_t begin = std::max(data_offset, (data_offset + first) / page_size * page_size);
+		file_size_t end = std::min(data_offset + data_size, (data_offset + last + page_size - 1) / page_size * page_size);
+
+		log_info() << "JOB " << id << " pwrite     " << *b << " items at " << begin << " - " << end - 1 << std::endl;
+
+		auto r = _pwrite(file->m_fd, b->m_data + (begin - data_offset), end - begin, begin);
+		assert(r == static_cast<ssize_t>(end - begin));
+		unused(r);
+#ifndef NDEBUG
+		total_bytes_written += end - begin;
+		total_write_calls++;
+#endif
+	}
+
+	job_lock.lock();
+
+	b->m_io = false;
+	file->free_block(job_lock, b);
+
+#ifndef NDEBUG
+	total_blocks_written++;
+#endif
 }
 
 void execute_write_job(lock_t & job_lock, file_impl * file, block * b) {
+	if (partial_write(file, b)) {
+		execute_partial_write_job(job_lock, file, b);
+		return;
+	}
+
+	b->clear_dirty_range();
+	b->m_disk_logical_size = b->m_logical_size;
+
 	block_size_t unserialized_size = b->m_logical_size * file->m_item_size;
 
 	block_header h;
@@ -240,6 +735,9 @@ void execute_write_job(lock_t & job_lock, file_impl * file, block * b) {
 	           << "First data " << reinterpret_cast<int*>(b->m_data)[0]
 	           << " " << reinterpret_cast<int*>(b->m_data)[1] << std::endl;
 
+	// All items were serialized when they were written, see open_flags::stage_serialized
+	bool staged = file->m_stage_serialized && b->m_staged_items == h.logical_size;
+
 	job_lock.unlock();
 
 	char * unserialized_data = b->m_data;
@@ -247,20 +745,31 @@ void execute_write_job(lock_t & job_lock, file_impl * file, block * b) {
 	char * physical_data = buffer2;
 
 	block_size_t serialized_size;
-	if (file->m_serialized) {
-		assert(b->m_serialized_size <= max_buffer_size);
-		file->do_serialize(unserialized_data, h.logical_size, serialized_data, &serialized_size);
-		assert(serialized_size == b->m_serialized_size);
-	} else {
-		serialized_size = unserialized_size;
-		serialized_data = unserialized_data;
-	}
-
 	size_t compressed_size;
-	if (file->m_compressed) {
-		assert(snappy::MaxCompressedLength(serialized_size) <= max_buffer_size - sizeof(block_header));
-		snappy::RawCompress(serialized_data, serialized_size, physical_data + sizeof(block_header), &compressed_size);
+	if (staged) {
+		serialized_size = b->m_serialized_size;
+		if (file->m_compressed) {
+			compressed_size = compress_staged_chunks(b, h.logical_size, serialized_size, physical_data + sizeof(block_header));
+		} else {
+			// The staged bytes have block_header padding like m_data
+			physical_data = b->m_staged - sizeof(block_header);
+			compressed_size = serialized_size;
+		}
+	} else if (file->m_compressed) {
+		// Serializing and compressing is done chunk by chunk
+		compressed_size = compress_chunks(file, unserialized_data, h.logical_size, physical_data + sizeof(block_header), &serialized_size);
+		assert(!file->m_serialized || serialized_size == b->m_serialized_size);
 	} else {
+		if (!file->plain_items()) {
+			assert(b->m_serialized_size <= max_buffer_size);
+			file->do_serialize(unserialized_data, h.logical_size, serialized_data, &serialized_size);
+			assert(serialized_size == b->m_serialized_size);
+		} else {
+			serialized_size = unserialized_size;
+			serialized_data = unserialized_data;
+			assert(!file->m_serialized || serialized_size == b->m_serialized_size);
+		}
+
 		// This is a valid pointer as both the block's m_data
 		// and our own buffers have block_header padding
 		physical_data = serialized_data - sizeof(block_header);
@@ -270,6 +779,8 @@ void execute_write_job(lock_t & job_lock, file_impl * file, block * b) {
 	block_size_t physical_size = 2 * sizeof(block_header) + compressed_size;
 
 	h.physical_size = physical_size;
+	h.checksum = file->m_checksum? block_checksum(h, physical_data + sizeof(h), compressed_size): 0;
+	h.reserved = 0;
 	memcpy(physical_data, &h, sizeof(block_header));
 	memcpy(physical_data + sizeof(h) + compressed_size, &h, sizeof(block_header));
 
@@ -281,16 +792,18 @@ void execute_write_job(lock_t & job_lock, file_impl * file, block * b) {
 
 	file_size_t off = b->m_physical_offset;
 	assert(is_known(off));
-	unused(off);
 
+	if (file->m_preallocation) file->preallocate(off + physical_size, file->m_preallocation);
 	auto r = _pwrite(file->m_fd, physical_data, physical_size, off);
 	assert(r == physical_size);
 	unused(r);
 #ifndef NDEBUG
 	total_bytes_written += physical_size;
+	total_write_calls++;
 #endif
 
 	job_lock.lock();
+	if (off + physical_size > file->m_memory_size) file->memory_size_changed(job_lock, off + physical_size);
 
 	log_info() << "JOB " << id << " written    " << *b << " at " <<  off << " - " << off + physical_size - 1 <<  " physical_size " << std::endl;
 
@@ -316,6 +829,7 @@ void execute_write_job(lock_t & job_lock, file_impl * file, block * b) {
 
 	b->m_physical_size = physical_size;
 	file->update_related_physical_sizes(job_lock, b);
+	file->commit_block(job_lock, b->m_block, off);
 	file->free_block(job_lock, b);
 
 #ifndef NDEBUG
@@ -323,12 +837,171 @@ void execute_write_job(lock_t & job_lock, file_impl * file, block * b) {
 #endif
 }
 
-void execute_truncate_job(lock_t &, file_impl * file, file_size_t truncate_size) {
+// Blocks of direct files are stored on disk exactly as in the block buffers,
+// with the headers just before and after the data.
+// So adjacent blocks can be read or written with one call scattering
+// straight into the buffers, as long as their physical sizes are known.
+bool can_coalesce(const job & j) {
+	if (j.type != job_type::read && j.type != job_type::write) return false;
+	if (!j.file->direct()) return false;
+	if (j.type == job_type::write && partial_write(j.file, j.io_block)) return false;
+	return is_known(j.io_block->m_physical_size) && is_known(j.io_block->m_physical_offset);
+}
+
+void execute_read_jobs(lock_t & job_lock, file_impl * file, const std::vector<block *> & bs) {
+	file_size_t off = bs.front()->m_physical_offset;
+	size_t size = 0;
+	std::vector<iovec> iov;
+	for (block * b : bs) {
+		assert(b->m_physical_offset == off + size);
+		iov.push_back({b->m_data - sizeof(block_header), b->m_physical_size});
+		size += b->m_physical_size;
+	}
+
+	job_lock.unlock();
+
+	log_info() << "JOB " << id << " preadv     " << bs.size() << " blocks from " << off << " - " << (off + size - 1) << std::endl;
+
+	auto r = _preadv(file->m_fd, iov.data(), static_cast<int>(iov.size()), off);
+	assert(r == static_cast<ssize_t>(size));
+	unused(r);
+#ifndef NDEBUG
+	total_bytes_read += size;
+#endif
+
+	std::vector<bool> checksum_errors(bs.size(), false);
+	if (file->m_checksum) {
+		for (size_t i = 0; i < bs.size(); i++) {
+			block * b = bs[i];
+			block_header h;
+			memcpy(&h, b->m_data - sizeof(block_header), sizeof(block_header));
+			block_size_t data_size = b->m_physical_size - 2 * sizeof(block_header);
+			checksum_errors[i] = h.physical_size != b->m_physical_size
+				|| memcmp(&h, b->m_data + data_size, sizeof(block_header)) != 0
+				|| h.checksum != block_checksum(h, b->m_data, data_size);
+		}
+	}
+
+	job_lock.lock();
+
+	std::vector<std::function<void()>> callbacks;
+	std::vector<block *> callback_blocks;
+	for (size_t i = 0; i < bs.size(); i++) {
+		block * b = bs[i];
+		block_header h;
+		memcpy(&h, b->m_data - sizeof(block_header), sizeof(block_header));
+		assert(checksum_errors[i] || h.physical_size == b->m_physical_size);
+
+		b->m_done_reading = true;
+		b->m_io = false;
+
+		if (checksum_errors[i]) {
+			log_info() << "JOB " << id << " checksum mismatch in " << *b << std::endl;
+			b->m_checksum_error = true;
+			b->m_logical_size = 0;
+			b->m_serialized_size = 0;
+		} else {
+			b->m_logical_size = h.logical_size;
+			b->m_disk_logical_size = h.logical_size;
+			b->m_logical_offset = h.logical_offset;
+			b->m_serialized_size = h.physical_size - 2 * sizeof(block_header);
+
+			if (b->m_block + 1 == file->m_blocks) {
+				file->m_last_block = b;
+			}
+		}
+
+		for (auto & c : b->m_read_callbacks) {
+			callbacks.push_back(std::move(c));
+			callback_blocks.push_back(b);
+		}
+		b->m_read_callbacks.clear();
+
+		file->free_block(job_lock, b);
+
+#ifndef NDEBUG
+		total_blocks_read++;
+#endif
+	}
+
+	if (!callbacks.empty()) {
+		job_lock.unlock();
+		for (auto & c : callbacks) c();
+		job_lock.lock();
+		for (block * b : callback_blocks) b->m_callbacks--;
+		global_cond.notify_all();
+	}
+}
+
+void execute_write_jobs(lock_t & job_lock, file_impl * file, const std::vector<block *> & bs) {
+	file_size_t off = bs.front()->m_physical_offset;
+	size_t size = 0;
+	std::vector<iovec> iov;
+	std::vector<block_header> headers;
+	for (block * b : bs) {
+		assert(b->m_physical_offset == off + size);
+		block_header h;
+		h.logical_size = b->m_logical_size;
+		h.logical_offset = b->m_logical_offset;
+		h.physical_size = b->m_physical_size;
+		h.checksum = 0;
+		h.reserved = 0;
+		assert(h.physical_size == h.logical_size * file->m_item_size + 2 * sizeof(block_header));
+		headers.push_back(h);
+		b->clear_dirty_range();
+		b->m_disk_logical_size = b->m_logical_size;
+
+		iov.push_back({b->m_data - sizeof(block_header), b->m_physical_size});
+		size += b->m_physical_size;
+	}
+
+	job_lock.unlock();
+
+	// The headers are filled in without the lock, as computing the checksums takes a while
+	for (size_t i = 0; i < bs.size(); i++) {
+		block_header & h = headers[i];
+		char * data = bs[i]->m_data;
+		block_size_t data_size = h.logical_size * file->m_item_size;
+		if (file->m_checksum) h.checksum = block_checksum(h, data, data_size);
+		memcpy(data - sizeof(block_header), &h, sizeof(block_header));
+		memcpy(data + data_size, &h, sizeof(block_header));
+	}
+
+	log_info() << "JOB " << id << " pwritev    " << bs.size() << " blocks at " << off << " - " << (off + size - 1) << std::endl;
+
+	if (file->m_preallocation) file->preallocate(off + size, file->m_preallocation);
+	auto r = _pwritev(file->m_fd, iov.data(), static_cast<int>(iov.size()), off);
+	assert(r == static_cast<ssize_t>(size));
+	unused(r);
+#ifndef NDEBUG
+	total_bytes_written += size;
+	total_write_calls++;
+#endif
+
+	job_lock.lock();
+	if (off + size > file->m_memory_size) file->memory_size_changed(job_lock, off + size);
+
+	for (block * b : bs) {
+#ifndef NDEBUG
+		block_offsets[file->m_file_id][b->m_block] = {b->m_physical_offset, b->m_physical_offset + b->m_physical_size};
+		total_blocks_written++;
+#endif
+		b->m_io = false;
+		file->update_related_physical_sizes(job_lock, b);
+		file->commit_block(job_lock, b->m_block, b->m_physical_offset);
+		file->free_block(job_lock, b);
+	}
+}
+
+void execute_truncate_job(lock_t & l, file_impl * file, file_size_t truncate_size) {
 	assert(is_known(truncate_size));
 
 	int r = ::ftruncate(file->m_fd, truncate_size);
 	assert(r == 0);
 	unused(r);
+	// Truncating released any space preallocated past the end
+	file->m_allocated_end = truncate_size;
+	file->memory_size_changed(l, truncate_size);
 
 	log_info() << "JOB " << id << " truncated  " << file->m_path << " to size " << truncate_size << std::endl;
 
@@ -353,7 +1026,11 @@ void process_run() {
 	lock_t job_lock(global_mutex);
 	log_info() << "JOB " << id << " start" << std::endl;
 	while (true) {
-		while (jobs.empty()) global_cond.wait(job_lock);
+		while (jobs.empty()) {
+			idle_job_threads++;
+			global_cond.wait(job_lock);
+			idle_job_threads--;
+		}
 		auto j = jobs.front();
 		// Don't pop the job as all threads should terminate
 		if (j.type == job_type::term) {
@@ -361,6 +1038,23 @@ void process_run() {
 			break;
 		}
 
+		// Helping another thread is not a job of the file
+		if (j.type == job_type::decompress) {
+			jobs.pop_front();
+			execute_decompress_job(job_lock, j.work);
+			continue;
+		}
+
+		// A sync job does the syncs of many files, and each of them is a job of its file
+		if (j.type == job_type::sync) {
+			jobs.pop_front();
+			if (j.sync)
+				execute_sync_help_job(job_lock, j.sync);
+			else
+				execute_sync_job(job_lock);
+			continue;
+		}
+
 		log_info() << "JOB " << id << " pop job    " << j.type << " ";
 		if (j.type == job_type::trunc) {
 			log_info() << j.truncate_size;
@@ -374,24 +1068,61 @@ void process_run() {
 		}
 		log_info() << "\n";
 
-		jobs.pop();
+		jobs.pop_front();
+
+		// Take the queued jobs for the blocks just before and after this one
+		std::vector<block *> run;
+		if (can_coalesce(j)) {
+			run.push_back(j.io_block);
+			bool found = true;
+			while (found && run.size() < max_coalesced_blocks) {
+				found = false;
+				for (auto it = jobs.begin(); it != jobs.end(); ++it) {
+					if (it->type != j.type || it->file != j.file || !can_coalesce(*it)) continue;
+					block * b = it->io_block;
+					if (b->m_physical_offset == run.back()->m_physical_offset + run.back()->m_physical_size) {
+						run.push_back(b);
+					} else if (b->m_physical_offset + b->m_physical_size == run.front()->m_physical_offset) {
+						run.insert(run.begin(), b);
+					} else {
+						continue;
+					}
+					log_info() << "JOB " << id << " coalesce   " << *b << "\n";
+					jobs.erase(it);
+					found = true;
+					break;
+				}
+			}
+		}
 
-		switch (j.type) {
-		case job_type::term:
-			assert(false);
-			break;
-		case job_type::read:
-			execute_read_job(job_lock, j.file, j.io_block);
-			break;
-		case job_type::write:
-			execute_write_job(job_lock, j.file, j.io_block);
-			break;
-		case job_type::trunc:
-			execute_truncate_job(job_lock, j.file, j.truncate_size);
-			break;
+		if (run.size() > 1) {
+			if (j.type == job_type::read)
+				execute_read_jobs(job_lock, j.file, run);
+			else
+				execute_write_jobs(job_lock, j.file, run);
+			j.file->m_job_count -= static_cast<uint32_t>(run.size() - 1);
+		} else {
+			switch (j.type) {
+			case job_type::term:
+				assert(false);
+				break;
+			case job_type::read:
+				execute_read_job(job_lock, j.file, j.io_block);
+				break;
+			case job_type::write:
+				execute_write_job(job_lock, j.file, j.io_block);
+				break;
+			case job_type::trunc:
+				execute_truncate_job(job_lock, j.file, j.truncate_size);
+				break;
+			case job_type::decompress:
+			case job_type::sync:
+				assert(false);
+				break;
+			}
 		}
 
-		j.file->m_job_count--;
+		j.file->job_done(job_lock);
 		global_cond.notify_all();
 	}
 
@@ -0,0 +1,130 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+///////////////////////////////////////////////////////////////////////////////
+/// \file merge.h  K-way merge of sorted streams using a loser tree
+///
+/// Every input hands out the items of its current block in batches through
+/// read_batch, so the merge loop only touches a stream when a batch runs out.
+/// Merged items are collected in a buffer and written with bulk writes.
+///////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#include <file_stream.h>
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <vector>
+
+template <typename T, typename Compare = std::less<T>>
+class kway_merger {
+public:
+	// Number of merged items buffered before they are written to the output
+	static constexpr size_t output_buffer_items() {
+		return std::max<size_t>(1, 64 * 1024 / sizeof(T));
+	}
+
+	kway_merger(Compare comp = Compare()): m_comp(comp) {}
+
+	// Adds an input reading at most items items from the current position of s.
+	// This is used when many sorted runs are stored in one file.
+	// The stream must stay alive until the merge is done.
+	template <typename S>
+	void add_input(S & s, file_size_t items = std::numeric_limits<file_size_t>::max()) {
+		input i;
+		i.m_remaining = items;
+		i.m_refill = [&s](file_size_t & remaining) -> std::pair<const T *, size_t> {
+			if (remaining == 0 || !s.can_read()) return {nullptr, 0};
+			size_t n = static_cast<size_t>(std::min<file_size_t>(remaining, std::numeric_limits<size_t>::max()));
+			const T * items = s.read_batch(n);
+			remaining -= n;
+			return {items, n};
+		};
+		m_inputs.push_back(std::move(i));
+	}
+
+	// Merges all inputs and writes them to out, which must support write(T *, size_t)
+	template <typename Out>
+	void merge(Out & out) {
+		size_t k = m_inputs.size();
+		if (k == 0) return;
+
+		for (size_t i = 0; i < k; i++) refill(i);
+		build();
+
+		std::vector<T> buffer;
+		buffer.reserve(output_buffer_items());
+		while (true) {
+			size_t w = m_tree[0];
+			input & in = m_inputs[w];
+			if (in.m_cur == in.m_end) break;
+
+			buffer.push_back(*in.m_cur);
+			if (buffer.size() == output_buffer_items()) {
+				out.write(buffer.data(), buffer.size());
+				buffer.clear();
+			}
+
+			if (++in.m_cur == in.m_end) refill(w);
+			replay(w);
+		}
+
+		if (!buffer.empty()) out.write(buffer.data(), buffer.size());
+		m_inputs.clear();
+	}
+
+private:
+	struct input {
+		const T * m_cur = nullptr;
+		const T * m_end = nullptr;
+		file_size_t m_remaining;
+		std::function<std::pair<const T *, size_t>(file_size_t &)> m_refill;
+	};
+
+	void refill(size_t i) {
+		input & in = m_inputs[i];
+		auto batch = in.m_refill(in.m_remaining);
+		in.m_cur = batch.first;
+		in.m_end = batch.first + batch.second;
+	}
+
+	// Exhausted inputs compare greater than everything else
+	bool less(size_t a, size_t b) const {
+		const input & ia = m_inputs[a];
+		const input & ib = m_inputs[b];
+		if (ia.m_cur == ia.m_end) return false;
+		if (ib.m_cur == ib.m_end) return true;
+		return m_comp(*ia.m_cur, *ib.m_cur);
+	}
+
+	// The tree has k - 1 internal nodes 1..k-1 storing the loser of the game
+	// played at that node and leaves k..2k-1 for the inputs.
+	// m_tree[0] is the overall winner.
+	void build() {
+		size_t k = m_inputs.size();
+		m_tree.assign(k, 0);
+		std::vector<size_t> winners(2 * k);
+		for (size_t i = 0; i < k; i++) winners[k + i] = i;
+		for (size_t n = k - 1; n >= 1; n--) {
+			size_t l = winners[2 * n];
+			size_t r = winners[2 * n + 1];
+			if (less(r, l)) std::swap(l, r);
+			winners[n] = l;
+			m_tree[n] = r;
+		}
+		m_tree[0] = winners[1];
+	}
+
+	// Replays the games from the leaf of input w to the root
+	void replay(size_t w) {
+		size_t k = m_inputs.size();
+		for (size_t n = (w + k) / 2; n >= 1; n /= 2) {
+			if (less(m_tree[n], w)) std::swap(m_tree[n], w);
+		}
+		m_tree[0] = w;
+	}
+
+	Compare m_comp;
+	std::vector<input> m_inputs;
+	std::vector<size_t> m_tree;
+};
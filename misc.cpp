@@ -48,7 +48,7 @@ void file_stream_term() {
 		j.type = job_type::term;
 		j.file = nullptr;
 		j.io_block = nullptr;
-		jobs.push(j);
+		jobs.push_back(j);
 		global_cond.notify_all();
 	}
 	l.unlock();
@@ -57,6 +57,7 @@ void file_stream_term() {
 		t.join();
 
 	l.lock();
+	destroy_shared_cache(l);
 	for (size_t i = 0; i < available_blocks(process_threads.size()); ++i)
 		destroy_available_block(l);
 
@@ -66,7 +67,7 @@ void file_stream_term() {
 	
 	process_threads.clear();
 
-	jobs.pop();
+	jobs.pop_front();
 	assert(jobs.size() == 0);
 }
 
@@ -0,0 +1,111 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+///////////////////////////////////////////////////////////////////////////////
+/// \file parallel.h  Scanning a file with several threads
+///
+/// The blocks of the file are split in contiguous ranges, one for each thread,
+/// using the block positions from file_base_base::block_positions. Every
+/// thread reads its range with its own stream, so each has its own readahead,
+/// and for compressed and serialized files the blocks are also decompressed
+/// and unserialized by the thread that needs them first.
+///
+/// Only files opened with open_flags::read_only may be read by several
+/// threads at once, other files are scanned by the calling thread alone.
+///////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#include <file_stream.h>
+#include <algorithm>
+#include <exception>
+#include <limits>
+#include <thread>
+#include <vector>
+
+namespace parallel_detail {
+
+inline size_t default_threads() {
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Calls scan(range, first, count) for each range of blocks, where first is the position
+// of the first item of the range and count the number of items in it.
+// Ranges are scanned on their own threads, range 0 on the calling thread.
+// The first exception thrown by a scan is rethrown when all threads are done.
+template <typename T, bool serialized, typename F>
+void for_each_range(file_base<T, serialized> & file, size_t threads, size_t & ranges, F scan) {
+	std::vector<stream_position> positions = file.block_positions();
+	if (file.is_writable()) threads = 1;
+	ranges = std::min<size_t>(std::max<size_t>(threads, 1), positions.size());
+	if (ranges == 0) return;
+
+	std::vector<std::exception_ptr> errors(ranges);
+	auto run = [&](size_t r) {
+		// Range r has the blocks [r * blocks / ranges, (r + 1) * blocks / ranges)
+		size_t first = r * positions.size() / ranges;
+		size_t last = (r + 1) * positions.size() / ranges;
+		file_size_t end = last == positions.size()? file.size(): positions[last].m_logical_offset;
+		try {
+			scan(r, positions[first], end - positions[first].m_logical_offset);
+		} catch (...) {
+			errors[r] = std::current_exception();
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (size_t r = 1; r < ranges; r++) workers.emplace_back(run, r);
+	run(0);
+	for (auto & w : workers) w.join();
+
+	for (auto & e : errors)
+		if (e) std::rethrow_exception(e);
+}
+
+// Reads count items from p, calling f for each batch of items
+template <typename T, bool serialized, typename F>
+void scan_items(file_base<T, serialized> & file, stream_position p, file_size_t count, F f) {
+	auto s = file.stream();
+	s.set_position(p);
+	while (count != 0) {
+		size_t n = static_cast<size_t>(std::min<file_size_t>(count, std::numeric_limits<size_t>::max()));
+		const T * items = s.read_batch(n);
+		f(items, n);
+		count -= n;
+	}
+}
+
+} //namespace parallel_detail
+
+// Calls f(item) for every item of the file, using up to threads threads.
+// The items of a range of blocks are visited in order by one thread,
+// but f is called from several threads at once.
+template <typename T, bool serialized, typename F>
+void parallel_for_each(file_base<T, serialized> & file, F f, size_t threads = parallel_detail::default_threads()) {
+	size_t ranges;
+	parallel_detail::for_each_range(file, threads, ranges, [&](size_t, stream_position p, file_size_t count) {
+		parallel_detail::scan_items(file, p, count, [&](const T * items, size_t n) {
+			for (size_t i = 0; i < n; i++) f(items[i]);
+		});
+	});
+}
+
+// Folds the items of each range of blocks into a copy of init with acc = op(acc, item),
+// and combines the results of the ranges in file order with result = combine(result, acc).
+// Returns init for an empty file.
+template <typename T, bool serialized, typename R, typename Op, typename Combine>
+R parallel_reduce(file_base<T, serialized> & file, R init, Op op, Combine combine,
+				  size_t threads = parallel_detail::default_threads()) {
+	std::vector<R> results(std::max<size_t>(threads, 1), init);
+	size_t ranges;
+	parallel_detail::for_each_range(file, threads, ranges, [&](size_t r, stream_position p, file_size_t count) {
+		R acc = init;
+		parallel_detail::scan_items(file, p, count, [&](const T * items, size_t n) {
+			for (size_t i = 0; i < n; i++) acc = op(std::move(acc), items[i]);
+		});
+		results[r] = std::move(acc);
+	});
+	if (ranges == 0) return init;
+	R result = std::move(results[0]);
+	for (size_t r = 1; r < ranges; r++) result = combine(std::move(result), std::move(results[r]));
+	return result;
+}
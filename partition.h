@@ -0,0 +1,237 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+///////////////////////////////////////////////////////////////////////////////
+/// \file partition.h  Buffered writer distributing items to many files
+///
+/// Every stream pins a block and adds a block to the pool, so keeping a
+/// stream open for each of thousands of partitions is not an option.
+/// Instead each partition gets a small staging buffer, and only a bounded
+/// number of streams are kept open at a time.
+///
+/// Appending to a partial last block rewrites the whole block, so when there
+/// are more partitions than streams, a file is only written once a partition
+/// has enough items to fill its last block.
+/// Until then full staging buffers are appended to a temporary spill file
+/// shared by all partitions. Plain items are written up to a block boundary,
+/// so the streams closed to make room for others have no partial block to
+/// write, and every item is written twice: once to the spill file and once
+/// to its partition. Blocks of serialized items end where the items stop
+/// fitting, so a partition gets at least a block of them at a time, and its
+/// partial last block is rewritten at most once per block written.
+///////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#include <file_stream.h>
+#include <exception.h>
+#include <log.h>
+#include <algorithm>
+#include <cassert>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct partition_options {
+	// Size in bytes of the staging buffer of each partition
+	size_t buffer_size = 64 * 1024;
+
+	// Maximum number of output streams open at the same time
+	size_t max_open_streams = 16;
+
+	// Directory to create the temporary spill file in, see open_flags::temporary
+	std::string temp_dir = "/tmp";
+
+	// Flags used for the spill file, by default it is compressed
+	open_flags::open_flags spill_flags = open_flags::default_flags;
+};
+
+template <typename T, bool serialized>
+class partitioner {
+public:
+	typedef file_base<T, serialized> file_type;
+	typedef stream_base<T, serialized> stream_type;
+
+	// Items written to partition i are appended to *outputs[i].
+	// The files must stay open until the partitioner is destroyed.
+	partitioner(std::vector<file_type *> outputs, partition_options options = partition_options())
+		: m_outputs(std::move(outputs))
+		, m_buffers(m_outputs.size())
+		, m_spilled(m_outputs.size())
+		, m_spilled_items(m_outputs.size(), 0)
+		, m_sizes(m_outputs.size())
+		, m_slot(m_outputs.size(), no_slot)
+		, m_options(std::move(options))
+		, m_buffer_items(std::max<size_t>(1, m_options.buffer_size / sizeof(T)))
+		, m_block_items(block_size() / sizeof(T))
+		, m_slots(std::max<size_t>(1, m_options.max_open_streams))
+		, m_clock(0) {
+		for (size_t i = 0; i < m_outputs.size(); i++) m_sizes[i] = m_outputs[i]->size();
+	}
+
+	partitioner(const partitioner &) = delete;
+	partitioner & operator=(const partitioner &) = delete;
+
+	// Writes what is left, but can't report errors doing so, call flush first to see them
+	~partitioner() {
+		try {
+			flush();
+		} catch (exception & e) {
+			log_info() << "PART  flush failed in destructor: " << e.what() << std::endl;
+		}
+	}
+
+	size_t partitions() const noexcept {return m_outputs.size();}
+
+	void write(size_t partition, T item) {
+		std::vector<T> & b = m_buffers[partition];
+		if (b.capacity() == 0) b.reserve(m_buffer_items);
+		b.push_back(std::move(item));
+		if (b.size() == m_buffer_items) buffer_full(partition);
+	}
+
+	// Writes all items of one partition to its file
+	void flush(size_t partition) {
+		size_t items = pending(partition);
+		if (items != 0) write_out(partition, items);
+	}
+
+	// Writes all items, closes all streams and removes the spill file
+	void flush() {
+		for (size_t i = 0; i < m_outputs.size(); i++) flush(i);
+		for (slot & sl : m_slots) {
+			if (!sl.m_stream) continue;
+			m_slot[sl.m_partition] = no_slot;
+			sl.m_stream.reset();
+		}
+		m_spill_stream.reset();
+		if (m_spill.is_open()) m_spill.close();
+	}
+
+private:
+	static constexpr size_t no_slot = static_cast<size_t>(-1);
+
+	struct slot {
+		std::unique_ptr<stream_type> m_stream;
+		size_t m_partition;
+		size_t m_last_use;
+	};
+
+	// Items of a partition in the spill file
+	struct segment {
+		stream_position m_start;
+		size_t m_items;
+	};
+
+	size_t pending(size_t partition) const {
+		return m_spilled_items[partition] + m_buffers[partition].size();
+	}
+
+	// Number of pending items to write to a partition now, or 0 if it should wait for more
+	size_t ready_items(size_t partition) const {
+		size_t items = pending(partition);
+		if (serialized) return items >= m_block_items? items: 0;
+		// Stop at the last block boundary
+		size_t past = static_cast<size_t>((m_sizes[partition] + items) % m_block_items);
+		return items - past;
+	}
+
+	void buffer_full(size_t partition) {
+		// With a stream for every partition, no stream is closed before the end
+		if (m_outputs.size() <= m_slots.size()) {
+			write_out(partition, pending(partition));
+			return;
+		}
+		size_t items = ready_items(partition);
+		if (items != 0) write_out(partition, items);
+		if (m_buffers[partition].size() == m_buffer_items) spill(partition);
+	}
+
+	void spill(size_t partition) {
+		if (!m_spill.is_open()) {
+			m_spill.open(m_options.temp_dir, m_options.spill_flags | open_flags::temporary);
+			m_spill_stream = std::unique_ptr<stream_type>(new stream_type(m_spill.stream()));
+		}
+		std::vector<T> & b = m_buffers[partition];
+		m_spilled[partition].push_back(segment{m_spill_stream->get_position(), b.size()});
+		m_spill_stream->write(b.data(), b.size());
+		m_spilled_items[partition] += b.size();
+		b.clear();
+	}
+
+	// Writes the first items pending for a partition to its file, spilled items first
+	void write_out(size_t partition, size_t items) {
+		stream_type & s = get_stream(partition);
+		size_t left = items;
+
+		std::vector<segment> & segments = m_spilled[partition];
+		if (!segments.empty()) {
+			stream_type r = m_spill.stream();
+			size_t done = 0;
+			for (; done < segments.size() && left != 0; done++) {
+				segment & sg = segments[done];
+				r.set_position(sg.m_start);
+				size_t n = std::min(left, sg.m_items);
+				// Copy a block of the spill file at a time
+				for (size_t i = 0; i < n;) {
+					size_t m = n - i;
+					const T * items = r.read_batch(m);
+					s.write(items, m);
+					i += m;
+				}
+				left -= n;
+				m_spilled_items[partition] -= n;
+				sg.m_items -= n;
+				if (sg.m_items != 0) {
+					sg.m_start = r.get_position();
+					break;
+				}
+			}
+			segments.erase(segments.begin(), segments.begin() + done);
+		}
+
+		std::vector<T> & b = m_buffers[partition];
+		assert(left <= b.size());
+		s.write(b.data(), left);
+		b.erase(b.begin(), b.begin() + left);
+		m_sizes[partition] += items;
+	}
+
+	stream_type & get_stream(size_t partition) {
+		size_t i = m_slot[partition];
+		if (i == no_slot) {
+			// Reuse the least recently used slot
+			i = 0;
+			for (size_t j = 1; j < m_slots.size() && m_slots[i].m_stream; j++) {
+				if (!m_slots[j].m_stream || m_slots[j].m_last_use < m_slots[i].m_last_use) i = j;
+			}
+
+			slot & sl = m_slots[i];
+			if (sl.m_stream) {
+				m_slot[sl.m_partition] = no_slot;
+				sl.m_stream.reset();
+			}
+			sl.m_stream = std::unique_ptr<stream_type>(new stream_type(m_outputs[partition]->stream()));
+			sl.m_stream->seek(0, whence::end);
+			sl.m_partition = partition;
+			m_slot[partition] = i;
+		}
+
+		m_slots[i].m_last_use = m_clock++;
+		return *m_slots[i].m_stream;
+	}
+
+	std::vector<file_type *> m_outputs;
+	std::vector<std::vector<T>> m_buffers;
+	std::vector<std::vector<segment>> m_spilled;
+	std::vector<size_t> m_spilled_items;
+	// Number of items in each file
+	std::vector<file_size_t> m_sizes;
+	std::vector<size_t> m_slot;
+	partition_options m_options;
+	size_t m_buffer_items;
+	size_t m_block_items;
+	std::vector<slot> m_slots;
+	size_t m_clock;
+	file_type m_spill;
+	std::unique_ptr<stream_type> m_spill_stream;
+};
@@ -34,8 +34,8 @@ def exprange(start, stop):
 
 bins = [False, True]
 
-items = 3
-tests = 8
+items = 4
+tests = 17
 
 TEST_RUNS = 1
 DEBUG = True
@@ -59,13 +59,30 @@ readahead_args = bins
 item_args = range(items)
 test_args = range(tests)
 merge_params = list(exprange(2, 512))
+# Reader threads of the parallel_read and parallel_scan tests
+reader_params = list(exprange(1, 16))
+# Bits of the gaps between the items of the integer_decode test
+gap_params = [0, 4, 16, 40]
+# Compression chunk sizes in KiB of the compress_blocks test, 0 compresses whole blocks
+chunk_params = [0, 16, 64, 256]
 job_args = range(1, 16 + 1)
+# Extra open_flags for the new streams, 16 is open_flags::stage_serialized (only for item type 1)
+# 32 is open_flags::integer_codec (only for item type 0)
+# 64 is open_flags::byte_shuffle (not for item type 1)
+# and 128 is open_flags::checksum
+flag_args = [0, 16, 32, 64, 128]
 
 
 def parameters(test):
 	# Merge tests
-	if test in [4, 5]:
+	if test in [4, 5, 9, 10, 11]:
 		return merge_params
+	elif test in [12, 13]:
+		return reader_params
+	elif test == 15:
+		return gap_params
+	elif test == 16:
+		return chunk_params
 	else:
 		return [0]
 
@@ -135,7 +152,7 @@ def kill_cache():
 now = lambda: time.clock_gettime(time.CLOCK_MONOTONIC_RAW)
 
 
-def run_test(bs, fs, compression, readahead, item, test, parameter, job_threads, old_streams):
+def run_test(bs, fs, compression, readahead, item, test, parameter, job_threads, extra_flags, old_streams):
 	format_partition()
 	path = build_path(DIRS[old_streams], bs, fs)
 	with chdir(path):
@@ -143,7 +160,7 @@ def run_test(bs, fs, compression, readahead, item, test, parameter, job_threads,
 			if action == 1:
 				kill_cache()
 				start = now()
-			args = [str(int(v)) for v in [compression, readahead, item, test, action, parameter, job_threads]]
+			args = [str(int(v)) for v in [compression, readahead, item, test, action, parameter, job_threads, extra_flags]]
 			all_args = ['./speed_test'] + args
 			print('Running', path, *all_args, file=sys.stderr)
 			p = run(all_args, stdout=PIPE, stderr=PIPE)
@@ -168,8 +185,31 @@ def get_arg_combinations():
 		for parameter in parameters(args[-1]):
 			# Add old_streams as last argument
 			for old_streams in bins:
+				# The serialized keyed_struct item type only exists for the new streams
+				if old_streams and args[4] == 3:
+					continue
 				for job_threads in get_job_threads(old_streams):
-					arg_combinations.append(args + (parameter, job_threads, old_streams))
+					# Extra open flags only exist for the new streams
+					for extra_flags in ([0] if old_streams else flag_args):
+						# Only serialized items that are not stored as their bytes are staged
+						if extra_flags & 16 and args[4] != 1:
+							continue
+						# The integer codec needs integral items
+						if extra_flags & 32 and args[4] != 0:
+							continue
+						# Byte shuffling needs items stored as their bytes
+						if extra_flags & 64 and args[4] == 1:
+							continue
+						# Shuffling blocks in memory only depends on the block and item size
+						if args[5] == 14 and (args[4] == 1 or old_streams or args[2] or args[3] or job_threads != 1 or extra_flags):
+							continue
+						# Decoding in memory only depends on the block size and the gaps
+						if args[5] == 15 and (args[4] != 0 or old_streams or args[2] or args[3] or job_threads != 1 or extra_flags):
+							continue
+						# Compressing in memory only depends on the block size, the items and the chunks
+						if args[5] == 16 and (old_streams or not args[2] or args[3] or job_threads != 1 or extra_flags):
+							continue
+						arg_combinations.append(args + (parameter, job_threads, extra_flags, old_streams))
 
 	return arg_combinations
 
@@ -199,7 +239,8 @@ def runall(output_file):
 					test=args[5],
 					parameter=args[6],
 					job_threads=args[7],
-					old_streams=args[8],
+					extra_flags=args[8],
+					old_streams=args[9],
 					duration=time,
 					timestamp=int(datetime.datetime.utcnow().timestamp()),
 				)
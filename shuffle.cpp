@@ -0,0 +1,248 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+#include <shuffle.h>
+#include <algorithm>
+#include <cstdint>
+#include <string.h>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// Items are transposed a tile at a time, so the tile being read stays in cache
+// while each of its byte columns is written out
+const size_t tile_items = 256;
+
+// Buffer of at least size bytes for the byte columns of a tile, kept by each thread
+// so chunks don't allocate and clear one every time
+char * tile_buffer(size_t size) {
+	thread_local std::vector<char> buffer;
+	if (buffer.size() < size) buffer.resize(size);
+	return buffer.data();
+}
+
+// Swaps the bytes selected by mask in a shifted by shift with those in b
+inline void swap_bytes(uint64_t & a, uint64_t & b, int shift, uint64_t mask) {
+	uint64_t t = ((a >> shift) ^ b) & mask;
+	b ^= t;
+	a ^= t << shift;
+}
+
+// Transposes the 8x8 byte matrix with the rows r[0..7] in place
+inline void transpose8x8(uint64_t * r) {
+	const uint64_t m1 = 0x00FF00FF00FF00FFull, m2 = 0x0000FFFF0000FFFFull, m4 = 0x00000000FFFFFFFFull;
+	swap_bytes(r[0], r[1], 8, m1);
+	swap_bytes(r[2], r[3], 8, m1);
+	swap_bytes(r[4], r[5], 8, m1);
+	swap_bytes(r[6], r[7], 8, m1);
+	swap_bytes(r[0], r[2], 16, m2);
+	swap_bytes(r[1], r[3], 16, m2);
+	swap_bytes(r[4], r[6], 16, m2);
+	swap_bytes(r[5], r[7], 16, m2);
+	swap_bytes(r[0], r[4], 32, m4);
+	swap_bytes(r[1], r[5], 32, m4);
+	swap_bytes(r[2], r[6], 32, m4);
+	swap_bytes(r[3], r[7], 32, m4);
+}
+
+void shuffle_generic(const char * in, size_t first, size_t last, size_t n, size_t s, char * out) {
+	for (size_t t = first; t < last; t += tile_items) {
+		size_t m = std::min(tile_items, last - t);
+		const char * tile = in + t * s;
+		for (size_t k = 0; k < s; k++) {
+			char * o = out + k * n + t;
+			for (size_t i = 0; i < m; i++) o[i] = tile[i * s + k];
+		}
+	}
+}
+
+void unshuffle_generic(const char * in, size_t first, size_t last, size_t n, size_t s, char * out) {
+	for (size_t t = first; t < last; t += tile_items) {
+		size_t m = std::min(tile_items, last - t);
+		char * tile = out + t * s;
+		for (size_t k = 0; k < s; k++) {
+			const char * p = in + k * n + t;
+			for (size_t i = 0; i < m; i++) tile[i * s + k] = p[i];
+		}
+	}
+}
+
+// Item sizes that are a multiple of 8 are transposed 8 items and 8 bytes at a time.
+// The byte columns of a tile are gathered in tmp, so they are written out in long runs
+// instead of 8 bytes at a time to addresses n bytes apart, which collide in the cache.
+void shuffle8(const char * in, size_t n, size_t s, char * out) {
+	size_t n8 = n - n % 8;
+	if (n8 == 0) {
+		shuffle_generic(in, 0, n, n, s, out);
+		return;
+	}
+	// Columns of a tile are w bytes apart in tmp
+	size_t w = std::min(tile_items, n8);
+	char * tmp = tile_buffer(s * w);
+	uint64_t r[8];
+	for (size_t t = 0; t < n8; t += tile_items) {
+		size_t m = std::min(tile_items, n8 - t);
+		for (size_t i = 0; i < m; i += 8) {
+			for (size_t g = 0; g < s; g += 8) {
+				for (size_t j = 0; j < 8; j++) memcpy(&r[j], in + (t + i + j) * s + g, 8);
+				transpose8x8(r);
+				for (size_t k = 0; k < 8; k++) memcpy(tmp + (g + k) * w + i, &r[k], 8);
+			}
+		}
+		for (size_t k = 0; k < s; k++) memcpy(out + k * n + t, tmp + k * w, m);
+	}
+	shuffle_generic(in, n8, n, n, s, out);
+}
+
+void unshuffle8(const char * in, size_t n, size_t s, char * out) {
+	size_t n8 = n - n % 8;
+	if (n8 == 0) {
+		unshuffle_generic(in, 0, n, n, s, out);
+		return;
+	}
+	size_t w = std::min(tile_items, n8);
+	char * tmp = tile_buffer(s * w);
+	uint64_t r[8];
+	for (size_t t = 0; t < n8; t += tile_items) {
+		size_t m = std::min(tile_items, n8 - t);
+		for (size_t k = 0; k < s; k++) memcpy(tmp + k * w, in + k * n + t, m);
+		for (size_t i = 0; i < m; i += 8) {
+			for (size_t g = 0; g < s; g += 8) {
+				for (size_t k = 0; k < 8; k++) memcpy(&r[k], tmp + (g + k) * w + i, 8);
+				transpose8x8(r);
+				for (size_t j = 0; j < 8; j++) memcpy(out + (t + i + j) * s + g, &r[j], 8);
+			}
+		}
+	}
+	unshuffle_generic(in, n8, n, n, s, out);
+}
+
+#ifdef __SSE2__
+// Transposes the 16x16 byte matrix with the rows x[0..15] in place.
+// Each round interleaves row i with row i + 8, after four rounds row k holds column k.
+inline void transpose16x16(__m128i * x) {
+	__m128i y[16];
+	for (int round = 0; round < 4; round++) {
+		for (int i = 0; i < 8; i++) {
+			y[2 * i] = _mm_unpacklo_epi8(x[i], x[i + 8]);
+			y[2 * i + 1] = _mm_unpackhi_epi8(x[i], x[i + 8]);
+		}
+		for (int i = 0; i < 16; i++) x[i] = y[i];
+	}
+}
+
+// Item sizes that are a multiple of 16 are transposed 16 items and 16 bytes at a time
+void shuffle16(const char * in, size_t n, size_t s, char * out) {
+	size_t n16 = n - n % 16;
+	if (n16 == 0) {
+		shuffle_generic(in, 0, n, n, s, out);
+		return;
+	}
+	size_t w = std::min(tile_items, n16);
+	char * tmp = tile_buffer(s * w);
+	__m128i x[16];
+	for (size_t t = 0; t < n16; t += tile_items) {
+		size_t m = std::min(tile_items, n16 - t);
+		for (size_t i = 0; i < m; i += 16) {
+			for (size_t g = 0; g < s; g += 16) {
+				for (size_t j = 0; j < 16; j++)
+					x[j] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + (t + i + j) * s + g));
+				transpose16x16(x);
+				for (size_t k = 0; k < 16; k++)
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(tmp + (g + k) * w + i), x[k]);
+			}
+		}
+		for (size_t k = 0; k < s; k++) memcpy(out + k * n + t, tmp + k * w, m);
+	}
+	shuffle_generic(in, n16, n, n, s, out);
+}
+
+void unshuffle16(const char * in, size_t n, size_t s, char * out) {
+	size_t n16 = n - n % 16;
+	if (n16 == 0) {
+		unshuffle_generic(in, 0, n, n, s, out);
+		return;
+	}
+	size_t w = std::min(tile_items, n16);
+	char * tmp = tile_buffer(s * w);
+	__m128i x[16];
+	for (size_t t = 0; t < n16; t += tile_items) {
+		size_t m = std::min(tile_items, n16 - t);
+		for (size_t k = 0; k < s; k++) memcpy(tmp + k * w, in + k * n + t, m);
+		for (size_t i = 0; i < m; i += 16) {
+			for (size_t g = 0; g < s; g += 16) {
+				for (size_t k = 0; k < 16; k++)
+					x[k] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(tmp + (g + k) * w + i));
+				transpose16x16(x);
+				for (size_t j = 0; j < 16; j++)
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(out + (t + i + j) * s + g), x[j]);
+			}
+		}
+	}
+	unshuffle_generic(in, n16, n, n, s, out);
+}
+#endif
+
+// The item size is a template parameter for the small sizes,
+// so the compiler can unroll and vectorize the inner loops
+template <size_t S>
+void shuffle_fixed(const char * in, size_t n, char * out) {
+	for (size_t t = 0; t < n; t += tile_items) {
+		size_t m = std::min(tile_items, n - t);
+		const char * tile = in + t * S;
+		for (size_t k = 0; k < S; k++) {
+			char * o = out + k * n + t;
+			for (size_t i = 0; i < m; i++) o[i] = tile[i * S + k];
+		}
+	}
+}
+
+template <size_t S>
+void unshuffle_fixed(const char * in, size_t n, char * out) {
+	for (size_t t = 0; t < n; t += tile_items) {
+		size_t m = std::min(tile_items, n - t);
+		char * tile = out + t * S;
+		for (size_t i = 0; i < m; i++)
+			for (size_t k = 0; k < S; k++) tile[i * S + k] = in[k * n + t + i];
+	}
+}
+
+} //namespace
+
+void shuffle(const char * in, size_t items, size_t item_size, char * out) {
+	switch (item_size) {
+	case 2: shuffle_fixed<2>(in, items, out); return;
+	case 4: shuffle_fixed<4>(in, items, out); return;
+	case 8: shuffle_fixed<8>(in, items, out); return;
+	}
+#ifdef __SSE2__
+	if (item_size % 16 == 0) {
+		shuffle16(in, items, item_size, out);
+		return;
+	}
+#endif
+	if (item_size % 8 == 0)
+		shuffle8(in, items, item_size, out);
+	else
+		shuffle_generic(in, 0, items, items, item_size, out);
+}
+
+void unshuffle(const char * in, size_t items, size_t item_size, char * out) {
+	switch (item_size) {
+	case 2: unshuffle_fixed<2>(in, items, out); return;
+	case 4: unshuffle_fixed<4>(in, items, out); return;
+	case 8: unshuffle_fixed<8>(in, items, out); return;
+	}
+#ifdef __SSE2__
+	if (item_size % 16 == 0) {
+		unshuffle16(in, items, item_size, out);
+		return;
+	}
+#endif
+	if (item_size % 8 == 0)
+		unshuffle8(in, items, item_size, out);
+	else
+		unshuffle_generic(in, 0, items, items, item_size, out);
+}
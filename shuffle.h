@@ -0,0 +1,21 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+///////////////////////////////////////////////////////////////////////////////
+/// \file shuffle.h  Byte shuffling of fixed size items
+///
+/// Used before compressing chunks of files opened with open_flags::byte_shuffle.
+/// Byte k of every item is moved next to byte k of the other items, so the
+/// compressor sees the slowly changing bytes of keys and other fields in long
+/// runs instead of interleaved with the rest of the item.
+///////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#include <cstddef>
+
+// Writes byte k of item i of the items items of item_size bytes in in
+// to out[k * items + i]
+void shuffle(const char * in, size_t items, size_t item_size, char * out);
+
+// Reverses shuffle
+void unshuffle(const char * in, size_t items, size_t item_size, char * out);
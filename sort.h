@@ -0,0 +1,197 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+///////////////////////////////////////////////////////////////////////////////
+/// \file sort.h  External merge sort on top of file streams
+///
+/// The input is split into runs that fit in the memory budget. Each run is
+/// sorted in memory and appended to a single run file, so a merge only needs
+/// one file with a stream per run, as in the merge_single_file speed test.
+/// Runs are then merged in as few passes as the memory budget allows.
+///////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#include <file_stream.h>
+#include <exception.h>
+#include <merge.h>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct sort_options {
+	// Total memory in bytes the sort may use for in-memory runs
+	// and for the blocks pinned by its streams
+	size_t memory = 256 * 1024 * 1024;
+
+	// Directory to create the temporary run files in, see open_flags::temporary
+	std::string temp_dir = "/tmp";
+
+	// Flags used for the run files, by default runs are compressed
+	open_flags::open_flags run_flags = open_flags::default_flags;
+};
+
+struct sort_run {
+	stream_position position;
+	file_size_t items;
+};
+
+template <typename T, bool serialized, typename Compare = std::less<T>>
+class external_sorter {
+public:
+	typedef file_base<T, serialized> file_type;
+	typedef stream_base<T, serialized> stream_type;
+
+	external_sorter(Compare comp = Compare(), sort_options options = sort_options())
+		: m_comp(comp), m_options(std::move(options)) {}
+
+	// Memory pinned in the block pool by a single stream
+	size_t stream_memory() const {
+		bool readahead = !(m_options.run_flags & open_flags::no_readahead);
+		size_t block_memory = sizeof(block_base);
+		if (serialized && !plain_serialized<T, serialized>() && (m_options.run_flags & open_flags::stage_serialized))
+			block_memory += staged_buffer_size();
+		return (readahead? 2: 1) * block_memory;
+	}
+
+	// Number of runs that can be merged at once within the memory budget.
+	// Every input stream and the output stream pin their blocks in the pool.
+	size_t fan_in() const {
+		size_t inputs = m_options.memory / stream_memory();
+		return std::max<size_t>(2, inputs > 1? inputs - 1: 0);
+	}
+
+	// Sorts the items from the current position of in to the end
+	// and writes them in sorted order to out
+	template <typename In, typename Out>
+	void sort(In & in, Out & out) {
+		// We need to be able to merge at least two runs
+		if (m_options.memory < 3 * stream_memory())
+			throw exception("Not enough memory for sorting, need at least "
+							+ std::to_string(3 * stream_memory()) + " bytes");
+
+		file_type run_file;
+		std::vector<sort_run> runs;
+		if (form_runs(in, out, run_file, runs))
+			return;
+
+		size_t f = fan_in();
+		while (runs.size() > f) {
+			// Merge into evenly sized groups so the next pass gets as few runs as possible
+			size_t groups = (runs.size() + f - 1) / f;
+			size_t group_size = (runs.size() + groups - 1) / groups;
+
+			file_type next_file;
+			std::vector<sort_run> next_runs;
+			next_file.open(m_options.temp_dir, m_options.run_flags | open_flags::temporary);
+			{
+				stream_type s = next_file.stream();
+				for (size_t i = 0; i < runs.size(); i += group_size) {
+					size_t j = std::min(runs.size(), i + group_size);
+					sort_run r{s.get_position(), 0};
+					for (size_t k = i; k < j; k++) r.items += runs[k].items;
+					merge_runs(run_file, runs.data() + i, runs.data() + j, s);
+					next_runs.push_back(r);
+				}
+			}
+
+			run_file.close();
+			run_file = std::move(next_file);
+			runs = std::move(next_runs);
+		}
+
+		merge_runs(run_file, runs.data(), runs.data() + runs.size(), out);
+		run_file.close();
+	}
+
+private:
+	// Memory used by an item while it is part of an in-memory run
+	static size_t item_memory(const T & item) {
+		if constexpr (serialized) {
+			struct Counter {
+				size_t s = 0;
+				void write(const char *, size_t size) {
+					s += size;
+				}
+			};
+			Counter c;
+			serialize(c, item);
+			return sizeof(T) + c.s;
+		} else {
+			unused(item);
+			return sizeof(T);
+		}
+	}
+
+	// Reads the input in runs that fit in memory and writes them sorted to the run file.
+	// If the entire input fits in a single run it is written directly to out
+	// and true is returned.
+	template <typename In, typename Out>
+	bool form_runs(In & in, Out & out, file_type & run_file, std::vector<sort_run> & runs) {
+		// The run file stream pins its blocks while we fill the buffer
+		size_t run_memory = m_options.memory - stream_memory();
+
+		std::vector<T> items;
+		if (!serialized) items.reserve(run_memory / sizeof(T));
+
+		std::unique_ptr<stream_type> s;
+		while (in.can_read()) {
+			size_t used = 0;
+			items.clear();
+			while (in.can_read() && used < run_memory) {
+				items.push_back(in.read());
+				used += item_memory(items.back());
+			}
+
+			std::sort(items.begin(), items.end(), m_comp);
+
+			if (!s) {
+				if (!in.can_read()) {
+					out.write(items.data(), items.size());
+					return true;
+				}
+				run_file.open(m_options.temp_dir, m_options.run_flags | open_flags::temporary);
+				s = std::unique_ptr<stream_type>(new stream_type(run_file.stream()));
+			}
+
+			runs.push_back(sort_run{s->get_position(), items.size()});
+			for (auto & item : items) s->write(std::move(item));
+		}
+
+		return !s;
+	}
+
+	// Merges the runs [first, last) stored in f and writes them to out
+	template <typename Out>
+	void merge_runs(file_type & f, const sort_run * first, const sort_run * last, Out & out) {
+		size_t k = last - first;
+
+		std::vector<stream_type> streams;
+		streams.reserve(k);
+
+		kway_merger<T, Compare> merger(m_comp);
+		for (size_t i = 0; i < k; i++) {
+			streams.push_back(f.stream());
+			streams[i].set_position(first[i].position);
+			merger.add_input(streams[i], first[i].items);
+		}
+		merger.merge(out);
+	}
+
+	Compare m_comp;
+	sort_options m_options;
+};
+
+// Sorts the rest of in and appends it to out
+template <typename T, bool serialized, typename Compare = std::less<T>>
+void external_sort(file_stream_base<T, serialized> & in, file_stream_base<T, serialized> & out,
+				   Compare comp = Compare(), sort_options options = sort_options()) {
+	external_sorter<T, serialized, Compare>(comp, std::move(options)).sort(in, out);
+}
+
+template <typename T, bool serialized, typename Compare = std::less<T>>
+void external_sort(stream_base<T, serialized> & in, stream_base<T, serialized> & out,
+				   Compare comp = Compare(), sort_options options = sort_options()) {
+	external_sorter<T, serialized, Compare>(comp, std::move(options)).sort(in, out);
+}
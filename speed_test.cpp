@@ -10,6 +10,7 @@
  *   - int
  *   - std::string
  *   - struct { int32_t key; char data[60]; }
+ *   - The same struct in a serialized stream
  *
  * - Test:
  *   - Write single
@@ -20,6 +21,13 @@
  *   - k-way merge using one file and multiple streams
  *   - 2-way distribute
  *   - Binary search (direct, uncompressed)
+ *   - External sort, parameter is the memory in MiB
+ *   - k-way merge and single file k-way merge using a loser tree
+ *   - k-way distribute using a buffered partitioner
+ *   - Parallel read and scan, parameter is the number of threads
+ *   - Byte shuffling of blocks in memory
+ *   - Integer codec decoding of blocks in memory, parameter is the bits of the gaps
+ *   - Compression of blocks in memory, parameter is the chunk size in KiB (0 for whole blocks)
  *
  * Tricks:
  * - No SSD, No swap
@@ -28,6 +36,13 @@
  */
 
 #include <file_stream.h>
+#include <merge.h>
+#include <partition.h>
+#include <sort.h>
+#include <parallel.h>
+#include <shuffle.h>
+#include <integer_codec.h>
+#include <snappy.h>
 
 #define TEST_DIR "/hdd/tmp/tpie_new_speed_test/"
 #define TEST_NEW_STREAMS
@@ -51,6 +66,9 @@ int main(int argc, char ** argv) {
 	case 2:
 		run_test<keyed_generator, file_stream<keyed_generator::keyed_struct>>();
 		break;
+	case 3:
+		run_test<keyed_generator, serialized_file_stream<keyed_generator::keyed_struct>>();
+		break;
 	default:
 		die("item_type out of range");
 	}
@@ -11,6 +11,9 @@
 #include <fstream>
 #include <chrono>
 #include <queue>
+#include <numeric>
+#include <thread>
+#include <atomic>
 
 #include <boost/filesystem/operations.hpp>
 #include <sstream>
@@ -72,6 +75,8 @@ struct {
 	action_t action;
 	size_t K;
 	size_t job_threads;
+	// Extra open_flags for the new streams, e.g. open_flags::stage_serialized
+	int extra_flags;
 } cmd_options;
 
 std::string readable_bytes(size_t bytes) {
@@ -92,8 +97,8 @@ std::string readable_bytes(size_t bytes) {
 }
 
 void speed_test_init(int argc, char ** argv) {
-	if (argc < 6 || argc > 8) {
-		std::cerr << "Usage: " << argv[0] << " compression readahead item_type test setup [extra param (K)] [job_threads]\n";
+	if (argc < 6 || argc > 9) {
+		std::cerr << "Usage: " << argv[0] << " compression readahead item_type test setup [extra param (K)] [job_threads] [extra open flags]\n";
 		std::exit(EXIT_FAILURE);
 	}
 	bool compression = (bool)std::atoi(argv[1]);
@@ -103,6 +108,7 @@ void speed_test_init(int argc, char ** argv) {
 	int action = std::atoi(argv[5]);
 	size_t K = (argc >= 7)? std::atoi(argv[6]): 0;
 	size_t job_threads = (argc >= 8)? std::atoi(argv[7]): 0;
+	int extra_flags = (argc >= 9)? std::atoi(argv[8]): 0;
 
 	const char * test_names[] = {
 		"write_single",
@@ -112,12 +118,22 @@ void speed_test_init(int argc, char ** argv) {
 		"merge",
 		"merge_single_file",
 		"distribute",
-		"binary_search"
+		"binary_search",
+		"sort",
+		"merge_loser_tree",
+		"merge_single_file_loser_tree",
+		"distribute_partitioner",
+		"parallel_read",
+		"parallel_scan",
+		"shuffle_blocks",
+		"integer_decode",
+		"compress_blocks"
 	};
 	const char * item_names[] = {
 		"int",
 		"std::string",
-		"keyed_struct"
+		"keyed_struct",
+		"serialized keyed_struct"
 	};
 	const char * action_names[] = {
 		"Setup",
@@ -146,7 +162,7 @@ void speed_test_init(int argc, char ** argv) {
 	if (job_threads != 0) die("job_thread parameter must be 0 for old streams");
 #endif
 
-	cmd_options = {compression, readahead, item_type, test, action_t(action), K, job_threads};
+	cmd_options = {compression, readahead, item_type, test, action_t(action), K, job_threads, extra_flags};
 
 	{
 		std::string word_path = "/usr/share/dict/words";
@@ -276,6 +292,7 @@ struct speed_test_t {
 			std::to_string(cmd_options.readahead) + "_" +
 			std::to_string(block_size()) + "_" +
 			std::to_string(cmd_options.K) + "_" +
+			std::to_string(cmd_options.extra_flags) + "_" +
 			std::to_string(file_ctr++);
 	}
 
@@ -284,6 +301,7 @@ struct speed_test_t {
 		open_flags::open_flags flags = open_flags::default_flags;
 		if (!cmd_options.compression) flags |= open_flags::no_compress;
 		if (!cmd_options.readahead) flags |= open_flags::no_readahead;
+		flags |= open_flags::open_flags(cmd_options.extra_flags);
 		return flags;
 	}
 
@@ -613,6 +631,40 @@ struct merge_single_file : speed_test_t<T, FS> {
 };
 #endif
 
+#ifdef TEST_NEW_STREAMS
+template <typename T, typename FS>
+struct merge_loser_tree : merge<T, FS> {
+	void run() override {
+		kway_merger<typename T::item_type> merger;
+		for (size_t i = 0; i < cmd_options.K; i++) {
+			merger.add_input(this->inputs[i]);
+		}
+		merger.merge(this->output);
+	}
+};
+
+template <typename T, typename FS>
+struct merge_single_file_loser_tree : merge_single_file<T, FS> {
+	void run() override {
+		using stream_info = typename merge_single_file<T, FS>::stream_info;
+		auto * stream_infos = new stream_info[cmd_options.K];
+		this->input.read_user_data(stream_infos, sizeof(stream_info) * cmd_options.K);
+
+		std::vector<decltype(this->input.stream())> streams;
+		streams.reserve(cmd_options.K);
+		kway_merger<typename T::item_type> merger;
+		for (size_t i = 0; i < cmd_options.K; i++) {
+			streams.push_back(this->input.stream());
+			streams[i].set_position(stream_infos[i].pos);
+			merger.add_input(streams[i], stream_infos[i].items);
+		}
+		merger.merge(this->output);
+
+		delete[] stream_infos;
+	}
+};
+#endif
+
 template <typename T, typename FS>
 struct distribute : speed_test_t<T, FS> {
 	FS outputs[2];
@@ -672,6 +724,69 @@ struct distribute : speed_test_t<T, FS> {
 	}
 };
 
+#ifdef TEST_NEW_STREAMS
+template <typename T, typename FS>
+struct distribute_partitioner : speed_test_t<T, FS> {
+	using F = typename speed_test_t<T, FS>::F;
+
+	template <typename>
+	struct partitioner_type;
+
+	template <bool S>
+	struct partitioner_type<file_base<typename T::item_type, S>> {
+		using type = partitioner<typename T::item_type, S>;
+	};
+
+	FS input;
+	std::vector<F> outputs;
+
+	void init() override {
+		if (cmd_options.K <= 0) {
+			die("Need positive parameter K for distribute test");
+		}
+		this->open_file_stream(input);
+
+		outputs.resize(cmd_options.K);
+		for (size_t i = 0; i < cmd_options.K; i++) {
+			this->open_file(outputs[i]);
+		}
+	}
+
+	void setup() override {
+		T gen;
+		for (size_t i = 0; i < this->total_items; i++) {
+			input.write(gen.next());
+		}
+	}
+
+	void run() override {
+		std::vector<F *> files;
+		for (auto & f : outputs) files.push_back(&f);
+
+		typename partitioner_type<F>::type p(files);
+		for (size_t i = 0; i < this->total_items; i++) {
+			p.write(i % cmd_options.K, input.read());
+		}
+		p.flush();
+	}
+
+	bool validate() override {
+		size_t total = 0;
+		for (size_t i = 0; i < cmd_options.K; i++) {
+			auto s = outputs[i].stream();
+			T gen;
+			gen.next(i);
+			while (s.can_read()) {
+				if (s.read() != gen.next(cmd_options.K)) return false;
+				total++;
+			}
+		}
+
+		return total == this->total_items;
+	}
+};
+#endif
+
 template <typename T, typename FS>
 struct binary_search : speed_test_t<T, FS> {
 	FS f;
@@ -733,6 +848,293 @@ struct binary_search : speed_test_t<T, FS> {
 	}
 };
 
+#ifdef TEST_NEW_STREAMS
+template <typename T, typename FS>
+struct sort : speed_test_t<T, FS> {
+	FS input;
+	FS output;
+
+	void init() override {
+		this->open_file_stream(input);
+		this->open_file_stream(output);
+	}
+
+	void setup() override {
+		ensure_open_write(input);
+
+		// Write the items in a fixed pseudo random order,
+		// item i is item i * stride (mod total_items) of the generator
+		size_t stride = 2654435761ull % this->total_items;
+		while (std::gcd(stride, this->total_items) != 1) stride++;
+
+		size_t j = 0;
+		for (size_t i = 0; i < this->total_items; i++) {
+			T gen;
+			gen.next(j);
+			input.write(gen.next());
+			j = (j + stride) % this->total_items;
+		}
+	}
+
+	void run() override {
+		ensure_open_read(input);
+		ensure_open_write(output);
+
+		sort_options options;
+		if (cmd_options.K) options.memory = cmd_options.K * MB;
+		options.temp_dir = TEST_DIR;
+		options.run_flags = this->get_flags();
+
+		input.seek(0, whence::set);
+		external_sort(input, output, std::less<typename T::item_type>(), options);
+	}
+
+	bool validate() override {
+		return this->validate_sequential(output);
+	}
+};
+#endif
+
+#ifdef TEST_NEW_STREAMS
+// K threads scan the whole file at once, each with its own stream on the read only file
+template <typename T, typename FS>
+struct parallel_read : speed_test_t<T, FS> {
+	using F = typename speed_test_t<T, FS>::F;
+
+	F f;
+
+	void init() override {
+		if (cmd_options.action == SETUP)
+			this->open_file(f);
+		else
+			f.open(this->get_fname(), this->get_flags() | open_flags::read_only);
+	}
+
+	void setup() override {
+		auto s = f.stream();
+		T gen;
+		for (size_t i = 0; i < this->total_items; i++) s.write(gen.next());
+	}
+
+	void run() override {
+		size_t threads = std::max<size_t>(cmd_options.K, 1);
+		std::atomic<size_t> total(0);
+		std::vector<std::thread> readers;
+		for (size_t t = 0; t < threads; t++) {
+			readers.emplace_back([this, &total]() {
+				auto s = f.stream();
+				size_t items = 0;
+				for (; s.can_read(); items++) s.read();
+				total += items;
+			});
+		}
+		for (auto & r : readers) r.join();
+		if (total != threads * this->total_items) die("Wrong number of items read");
+	}
+
+	bool validate() override {
+		auto s = f.stream();
+		T gen;
+		for (size_t i = 0; i < this->total_items; i++) {
+			if (s.read() != gen.next()) return false;
+		}
+		return !s.can_read();
+	}
+};
+
+// Scans the file once, split in ranges of blocks read by K threads
+template <typename T, typename FS>
+struct parallel_scan : parallel_read<T, FS> {
+	void run() override {
+		size_t threads = std::max<size_t>(cmd_options.K, 1);
+		size_t total = parallel_reduce(this->f, size_t(0), [](size_t items, const typename T::item_type &) {return items + 1;}, std::plus<size_t>(), threads);
+		if (total != this->total_items) die("Wrong number of items read");
+	}
+};
+#endif
+
+#ifdef TEST_NEW_STREAMS
+// Shuffles and unshuffles a file size of items in memory, a block at a time,
+// to time the transform of open_flags::byte_shuffle without the compression and I/O.
+// Only for items stored as their bytes.
+template <typename T, typename FS>
+struct shuffle_blocks : speed_test_t<T, FS> {
+	using item_type = typename T::item_type;
+
+	size_t block_items = block_size() / sizeof(item_type);
+	std::vector<char> items, shuffled;
+
+	void init() override {
+		if (!std::is_trivially_copyable<item_type>::value) skip();
+		items.resize(block_items * sizeof(item_type));
+		shuffled.resize(items.size());
+		T gen;
+		for (size_t i = 0; i < block_items; i++) {
+			item_type x = gen.next();
+			memcpy(items.data() + i * sizeof(item_type), &x, sizeof(item_type));
+		}
+	}
+
+	void setup() override {}
+
+	void run() override {
+		for (size_t i = 0; i < this->total_items; i += block_items) {
+			shuffle(items.data(), block_items, sizeof(item_type), shuffled.data());
+			unshuffle(shuffled.data(), block_items, sizeof(item_type), items.data());
+		}
+		std::cerr << "Shuffled and unshuffled " << readable_bytes(this->total_items * sizeof(item_type)) << "\n";
+	}
+
+	bool validate() override {
+		std::vector<char> original = items;
+		shuffle(items.data(), block_items, sizeof(item_type), shuffled.data());
+		unshuffle(shuffled.data(), block_items, sizeof(item_type), items.data());
+		return items == original;
+	}
+};
+
+// Decodes a block of integer_codec compressed items a file size of times in memory,
+// to time the decompression of open_flags::integer_codec without the I/O.
+// The parameter is the number of bits of the gaps between the sorted items.
+// Only for integral items.
+template <typename T, typename FS>
+struct integer_decode : speed_test_t<T, FS> {
+	using item_type = typename T::item_type;
+
+	size_t block_items = block_size() / sizeof(item_type);
+	std::vector<item_type> items, decoded;
+	std::vector<char> compressed;
+
+	void init() override {
+		if constexpr (!std::is_integral<item_type>::value) {
+			skip();
+		} else {
+			if (cmd_options.K >= 64) skip();
+			items.resize(block_items);
+			decoded.resize(block_items);
+			std::mt19937_64 rng(42);
+			uint64_t x = 0;
+			for (size_t i = 0; i < block_items; i++) {
+				if (cmd_options.K) x += rng() >> (64 - cmd_options.K);
+				items[i] = item_type(x);
+			}
+			compressed.resize(integer_max_compressed_length(block_items, sizeof(item_type)));
+			compressed.resize(integer_compress(reinterpret_cast<const char *>(items.data()), block_items,
+											   sizeof(item_type), compressed.data()));
+		}
+	}
+
+	void setup() override {}
+
+	void run() override {
+		for (size_t i = 0; i < this->total_items; i += block_items)
+			integer_uncompress(compressed.data(), block_items, sizeof(item_type), reinterpret_cast<char *>(decoded.data()));
+		std::cerr << "Decoded " << readable_bytes(this->total_items * sizeof(item_type)) << " from blocks compressed to "
+				  << readable_bytes(compressed.size()) << "\n";
+	}
+
+	bool validate() override {
+		integer_uncompress(compressed.data(), block_items, sizeof(item_type), reinterpret_cast<char *>(decoded.data()));
+		return decoded == items;
+	}
+};
+#endif
+
+#ifdef TEST_NEW_STREAMS
+template <typename FS>
+struct stream_codec;
+
+template <typename T, bool serialized>
+struct stream_codec<file_stream_base<T, serialized>>: item_codec_for<T, serialized> {};
+
+// Compresses and decompresses a file size of items in memory, a block at a time,
+// to time the compression of blocks without the I/O. The parameter is the size in KiB
+// of the compression chunks, see compression_chunk_size(), and 0 serializes and compresses
+// whole blocks through buffers of a block like before the blocks were chunked.
+template <typename T, typename FS>
+struct compress_blocks : speed_test_t<T, FS> {
+	using item_type = typename T::item_type;
+
+	const item_codec & codec = stream_codec<FS>::codec;
+	bool plain = !codec.serialized || codec.trivially_serializable;
+	block_size_t block_items = block_size() / sizeof(item_type);
+	block_size_t chunk_size;
+	std::vector<item_type> items;
+	std::vector<char> decoded, serialized, compressed;
+	// Items and compressed size of each chunk
+	std::vector<std::pair<block_size_t, size_t>> chunks;
+
+	void init() override {
+		chunk_size = cmd_options.K? cmd_options.K * 1024: std::numeric_limits<block_size_t>::max();
+		T gen;
+		for (block_size_t i = 0; i < block_items; i++) items.push_back(gen.next());
+		decoded.resize(block_items * sizeof(item_type));
+
+		block_size_t serialized_size = block_items * sizeof(item_type);
+		if (!plain) codec.serialize(reinterpret_cast<const char *>(items.data()), block_items, nullptr,
+									std::numeric_limits<block_size_t>::max(), &serialized_size);
+		serialized.resize(serialized_size);
+		size_t max_chunks = serialized_size / std::min<size_t>(chunk_size, serialized_size) + 1;
+		compressed.resize(snappy::MaxCompressedLength(serialized_size) + max_chunks * snappy::MaxCompressedLength(0));
+	}
+
+	void setup() override {}
+
+	void compress() {
+		const char * in = reinterpret_cast<const char *>(items.data());
+		size_t out_size = 0;
+		chunks.clear();
+		for (block_size_t i = 0; i < block_items;) {
+			block_size_t n, size;
+			const char * data;
+			if (plain) {
+				n = std::min<block_size_t>(block_items - i, std::max<block_size_t>(1, chunk_size / sizeof(item_type)));
+				size = n * sizeof(item_type);
+				data = in + i * sizeof(item_type);
+			} else {
+				n = codec.serialize(in + i * sizeof(item_type), block_items - i, serialized.data(), chunk_size, &size);
+				data = serialized.data();
+			}
+			size_t compressed_size;
+			snappy::RawCompress(data, size, compressed.data() + out_size, &compressed_size);
+			chunks.emplace_back(n, compressed_size);
+			out_size += compressed_size;
+			i += n;
+		}
+	}
+
+	void decompress() {
+		size_t in_offset = 0;
+		block_size_t i = 0;
+		for (auto c : chunks) {
+			char * out = decoded.data() + i * sizeof(item_type);
+			snappy::RawUncompress(compressed.data() + in_offset, c.second, plain? out: serialized.data());
+			if (!plain) codec.unserialize(serialized.data(), c.first, out);
+			in_offset += c.second;
+			i += c.first;
+		}
+	}
+
+	void run() override {
+		for (size_t i = 0; i < this->total_items; i += block_items) {
+			compress();
+			decompress();
+			codec.destruct(decoded.data(), block_items);
+		}
+		std::cerr << "Compressed and decompressed " << readable_bytes(this->total_items * sizeof(item_type))
+				  << " in " << chunks.size() << " chunks per block\n";
+	}
+
+	bool validate() override {
+		compress();
+		decompress();
+		bool ok = std::equal(items.begin(), items.end(), reinterpret_cast<const item_type *>(decoded.data()));
+		codec.destruct(decoded.data(), block_items);
+		return ok;
+	}
+};
+#endif
+
 // Disable binary_search test for old serialization streams
 #ifdef TEST_OLD_STREAMS
 template <typename T>
@@ -796,6 +1198,78 @@ void run_test() {
 	}
 	case 6: test = new distribute<T, FS>(); break;
 	case 7: test = new binary_search<T, FS>(); break;
+	case 8: {
+#ifdef TEST_NEW_STREAMS
+		test = new sort<T, FS>();
+#else
+		skip();
+#endif
+		break;
+	}
+	case 9: {
+#ifdef TEST_NEW_STREAMS
+		test = new merge_loser_tree<T, FS>();
+#else
+		skip();
+#endif
+		break;
+	}
+	case 10: {
+#ifdef TEST_NEW_STREAMS
+		test = new merge_single_file_loser_tree<T, FS>();
+#else
+		skip();
+#endif
+		break;
+	}
+	case 11: {
+#ifdef TEST_NEW_STREAMS
+		test = new distribute_partitioner<T, FS>();
+#else
+		skip();
+#endif
+		break;
+	}
+	case 12: {
+#ifdef TEST_NEW_STREAMS
+		test = new parallel_read<T, FS>();
+#else
+		skip();
+#endif
+		break;
+	}
+	case 13: {
+#ifdef TEST_NEW_STREAMS
+		test = new parallel_scan<T, FS>();
+#else
+		skip();
+#endif
+		break;
+	}
+	case 14: {
+#ifdef TEST_NEW_STREAMS
+		test = new shuffle_blocks<T, FS>();
+#else
+		skip();
+#endif
+		break;
+	}
+	case 15: {
+#ifdef TEST_NEW_STREAMS
+		test = new integer_decode<T, FS>();
+#else
+		skip();
+#endif
+		break;
+	}
+	case 16: {
+#ifdef TEST_NEW_STREAMS
+		test = new compress_blocks<T, FS>();
+#else
+		skip();
+#endif
+		break;
+	}
 	default: die("test index out of range");
 	}
 
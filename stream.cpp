@@ -2,6 +2,7 @@
 // vi:set ts=4 sts=4 sw=4 noet :
 #include <file_stream_impl.h>
 #include <cassert>
+#include <vector>
 #include "exception.h"
 
 block_base void_block;
@@ -10,24 +11,29 @@ stream_base_base::stream_base_base(file_base_base * file_base)
 	: m_block(nullptr)
 	, m_file_base(file_base)
 	, m_impl(nullptr)
-	, m_cur_index(0) {
+	, m_cur_index(0)
+	, m_stage_serialized(file_base->m_impl->m_stage_serialized) {
 	m_impl = new stream_impl();
 	m_impl->m_outer = this;
 	m_impl->m_file = file_base->m_impl;
-	m_impl->m_file->m_streams.insert(m_impl);
 	m_block = &void_block;
 
+	// Streams of read only files may be created by several threads at once
 	lock_t l(global_mutex);
-	create_available_block(l);
-	if (m_impl->m_file->m_readahead)
-		create_available_block(l);
+	m_impl->m_file->m_streams.insert(m_impl);
+	m_impl->m_advice = m_impl->m_file->m_advice;
+	m_impl->m_readahead_slot = m_impl->m_file->m_readahead;
+	create_available_block(l, m_impl->m_file);
+	if (m_impl->m_readahead_slot)
+		create_available_block(l, m_impl->m_file);
 }
 
 stream_base_base::stream_base_base(stream_base_base && o)
 	: m_block(o.m_block)
 	, m_file_base(o.m_file_base)
 	, m_impl(o.m_impl)
-	, m_cur_index(o.m_cur_index) {
+	, m_cur_index(o.m_cur_index)
+	, m_stage_serialized(o.m_stage_serialized) {
 
 	if (m_impl) {
 		m_impl->m_outer = this;
@@ -49,6 +55,7 @@ stream_base_base & stream_base_base::operator=(stream_base_base && o) {
 	m_file_base = o.m_file_base;
 	m_impl = o.m_impl;
 	m_cur_index = o.m_cur_index;
+	m_stage_serialized = o.m_stage_serialized;
 
 	if (m_impl) {
 		m_impl->m_outer = this;
@@ -88,6 +95,19 @@ void stream_base_base::serialize_block_overflow(block_size_t serialized_size) {
 }
 
 
+void stream_base_base::stage_overflow(block_size_t serialized_size) {
+	// The item was staged past the end of the block, move it to the next block
+	std::vector<char> item;
+	if (serialized_size <= max_serialized_block_size())
+		item.assign(m_block->m_staged + m_block->m_serialized_size, m_block->m_staged + m_block->m_serialized_size + serialized_size);
+
+	serialize_block_overflow(serialized_size);
+
+	// Blocks of a staged file always have staged bytes
+	assert(m_block->m_staged && m_block->m_staged_items == 0 && m_block->m_serialized_size == 0);
+	memcpy(m_block->m_staged, item.data(), serialized_size);
+}
+
 void stream_base_base::seek(file_size_t off, whence w) {
 	m_impl->seek(off, w);
 }
@@ -113,6 +133,20 @@ void stream_base_base::set_position(stream_position p) {
 	m_impl->set_position(l, p);
 }
 
+void stream_base_base::advise(access_pattern pattern) {
+	lock_t l(global_mutex);
+	m_impl->m_advice = pattern;
+	if (pattern == access_pattern::random) {
+		m_impl->m_file->free_readahead_block(l, m_impl->m_readahead_block);
+		m_impl->m_readahead_block = nullptr;
+	}
+}
+
+void stream_base_base::prefetch(stream_position p) {
+	lock_t l(global_mutex);
+	m_impl->prefetch(l, p);
+}
+
 #ifndef NDEBUG
 block_base * stream_base_base::get_last_block() {
 	return m_file_base->m_impl->m_last_block;
@@ -128,15 +162,42 @@ stream_impl::~stream_impl() {
 		m_file->free_readahead_block(l, m_readahead_block);
 	}
 
-	destroy_available_block(l);
-	if (m_file->m_readahead)
-		destroy_available_block(l);
+	destroy_available_block(l, m_file);
+	if (m_readahead_slot)
+		destroy_available_block(l, m_file);
 
 	size_t c = m_file->m_streams.erase(this);
 	assert(c == 1);
 	unused(c);
 }
 
+bool stream_impl::readahead(bool forward) const {
+	if (!m_file->m_readahead) return false;
+	switch (m_advice) {
+	case access_pattern::normal: return true;
+	case access_pattern::sequential: return forward;
+	case access_pattern::reverse: return !forward;
+	case access_pattern::random: return false;
+	}
+	return false;
+}
+
+void stream_impl::prefetch(lock_t & l, stream_position p) {
+	if (p.m_block >= m_file->m_blocks) return;
+	if (m_cur_block && m_cur_block->m_block == p.m_block) return;
+	if (m_readahead_block && m_readahead_block->m_block == p.m_block) return;
+
+	if (!m_readahead_slot) {
+		// The file was opened without readahead, so we have not added a block to the pool for it yet
+		create_available_block(l, m_file);
+		m_readahead_slot = true;
+	}
+
+	m_file->free_readahead_block(l, m_readahead_block);
+	m_readahead_block = m_file->get_block(l, p, true, nullptr, false);
+	m_readahead_block->m_readahead_usage++;
+}
+
 void stream_impl::next_block() {
 	lock_t lock(global_mutex);
 	block * b = m_cur_block;
@@ -146,7 +207,7 @@ void stream_impl::next_block() {
 	m_outer->m_cur_index = 0;
 	m_outer->m_block = m_cur_block;
 
-	if (m_file->m_readahead && m_cur_block->m_block + 1 != m_file->m_blocks) {
+	if (readahead(true) && m_cur_block->m_block + 1 != m_file->m_blocks) {
 		m_file->free_readahead_block(lock, m_readahead_block);
 		m_readahead_block = m_file->get_successor_block(lock, m_cur_block, false);
 		m_readahead_block->m_readahead_usage++;
@@ -162,7 +223,7 @@ void stream_impl::prev_block() {
 	m_outer->m_cur_index = m_cur_block->m_logical_size;
 	m_outer->m_block = m_cur_block;
 
-	if (m_file->m_readahead && m_cur_block->m_block != 0) {
+	if (readahead(false) && m_cur_block->m_block != 0) {
 		m_file->free_readahead_block(lock, m_readahead_block);
 		m_readahead_block = m_file->get_predecessor_block(lock, m_cur_block, false);
 		m_readahead_block->m_readahead_usage++;
@@ -175,8 +236,13 @@ void stream_impl::set_position(lock_t & l, stream_position p) {
 		return;
 	}
 
-	if (m_cur_block)
+	if (m_cur_block) {
 		m_file->free_block(l, m_cur_block);
+		// Leave the stream at the start if get_block throws
+		m_cur_block = nullptr;
+		m_outer->m_block = &void_block;
+		m_outer->m_cur_index = 0;
+	}
 
 	m_cur_block = m_file->get_block(l, p);
 	m_outer->m_cur_index = p.m_index;
@@ -8,8 +8,19 @@
 #include <set>
 #include <csignal>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <sstream>
+#include <fstream>
+#include <chrono>
 #include <atomic>
+#include <thread>
+#include <merge.h>
+#include <partition.h>
+#include <sort.h>
+#include <parallel.h>
+#include <integer_codec.h>
+#include <shuffle.h>
 #include "check_file.h"
 
 open_flags::open_flags compression_flag = open_flags::default_flags;
@@ -826,6 +837,1691 @@ int read_seq() {
 	return EXIT_SUCCESS;
 }
 
+int prefetch_test() {
+	file<int> f;
+	f.open(TMP_FILE, compression_flag);
+	std::vector<stream_position> positions;
+	int b;
+	{
+		auto s = f.stream();
+		b = (int) s.logical_block_size();
+		for (int i = 0; i < 20 * b; i++) {
+			if (i % b == 0) positions.push_back(s.get_position());
+			s.write(i);
+		}
+	}
+
+	// More blocks than the file keeps, and a position past the end
+	for (auto & p : positions) f.prefetch(p);
+	f.prefetch(f.stream().get_position());
+	f.prefetch(0, 20 * b);
+	{
+		auto s = f.stream();
+		s.advise(access_pattern::random);
+		for (int i = 19; i >= 0; i -= 3) {
+			s.prefetch(positions[i]);
+			s.set_position(positions[i]);
+			ensure(i * b, s.read(), "read");
+		}
+	}
+
+	f.drop(0, 20 * b);
+	f.advise(access_pattern::reverse);
+	{
+		auto s = f.stream();
+		s.seek(0, whence::end);
+		for (int i = 20 * b - 1; i >= 0; i--)
+			ensure(i, s.read_back(), "read_back");
+	}
+
+	// Prefetched blocks must not keep us from truncating or closing
+	f.prefetch(positions[15]);
+	f.truncate(positions[10]);
+	f.truncate(f.size());
+	ensure<file_size_t>(10 * b, f.size(), "size");
+	f.prefetch(positions[3]);
+	f.close();
+
+	f.open(TMP_FILE, open_flags::no_compress | open_flags::truncate | open_flags::no_readahead);
+	{
+		auto s = f.stream();
+		for (int i = 0; i < 20 * b; i++)
+			s.write(i);
+		f.prefetch(5 * b + 7, 3 * b);
+		s.prefetch(positions[1]);
+		f.drop(0, 5 * b);
+		s.seek(5 * b + 7);
+		ensure(5 * b + 7, s.read(), "read");
+		s.seek(b / 2);
+		ensure(b / 2, s.read(), "read");
+	}
+	f.drop(0, f.size());
+
+	return EXIT_SUCCESS;
+}
+
+#ifndef NDEBUG
+int64_t get_total_write_calls();
+#endif
+
+int coalesced_io() {
+	int b;
+	{
+		file<int> f;
+		f.open(TMP_FILE, open_flags::no_compress);
+		auto s = f.stream();
+		b = (int) s.logical_block_size();
+		for (int i = 0; i < 20 * b + 5; i++)
+			s.write(i);
+	}
+
+	file<int> f;
+	f.open(TMP_FILE, open_flags::no_compress | open_flags::no_readahead);
+	// All reads are queued at once, so they are done with a few large reads
+	f.prefetch(3 * b, 20 * b);
+	f.prefetch(0, 3 * b);
+	{
+		auto s = f.stream();
+		for (int i = 0; i < 20 * b + 5; i++)
+			ensure(i, s.read(), "read");
+	}
+	f.close();
+
+	// The only job thread is kept busy by a read callback while streams overwrite
+	// an item in each of the first blocks, so their writes are queued together.
+	// Blocks with checksums are written in full, see partial_write.
+	const int blocks = 8;
+	file_stream_term();
+	file_stream_init(1);
+	f.open(TMP_FILE, open_flags::truncate | open_flags::no_compress | open_flags::checksum);
+	{
+		auto s = f.stream();
+		for (int i = 0; i < 20 * b + 5; i++)
+			s.write(i);
+	}
+	f.close();
+	std::string path = std::string(TMP_FILE) + ".busy";
+	{
+		file<int> busy;
+		busy.open(path, open_flags::truncate | compression_flag);
+		{
+			auto s = busy.stream();
+			for (int i = 0; i < 10; i++) s.write(i);
+		}
+		busy.close();
+		busy.open(path, compression_flag);
+
+		std::atomic_bool started(false), release(false);
+		auto fut = busy.read_async(busy.stream().get_position(), [&]() {
+			started = true;
+			while (!release) std::this_thread::yield();
+		});
+		while (!started) std::this_thread::yield();
+
+		f.open(TMP_FILE, open_flags::no_compress | open_flags::checksum | open_flags::no_readahead);
+#ifndef NDEBUG
+		int64_t calls = get_total_write_calls();
+#endif
+		{
+			std::vector<stream<int>> streams;
+			for (int j = 0; j < blocks; j++) {
+				streams.push_back(f.stream());
+				streams.back().seek(j * b + 1);
+				streams.back().write(-(j * b + 1));
+			}
+			// Moving the streams to a block another stream holds queues the writes
+			// without taking a block from the pool, which would wait for the job thread
+			streams.push_back(f.stream());
+			streams.back().seek(blocks * b);
+			for (int j = 0; j < blocks; j++) streams[j].seek(blocks * b);
+			release = true;
+			fut.wait();
+		}
+		f.close();
+#ifndef NDEBUG
+		ensure(true, get_total_write_calls() - calls < blocks, "write calls");
+#endif
+	}
+	::unlink(path.c_str());
+
+	f.open(TMP_FILE, open_flags::no_compress | open_flags::checksum);
+	auto s = f.stream();
+	for (int i = 0; i < 20 * b + 5; i++)
+		ensure(i % b == 1 && i < blocks * b? -i: i, s.read(), "read overwritten");
+
+	return EXIT_SUCCESS;
+}
+
+#ifndef NDEBUG
+int64_t get_total_bytes_written();
+#endif
+
+int partial_block_writes() {
+	int b;
+	{
+		file<int> f;
+		f.open(TMP_FILE, open_flags::no_compress);
+		auto s = f.stream();
+		b = (int) s.logical_block_size();
+		for (int i = 0; i < 4 * b + 5; i++)
+			s.write(i);
+	}
+
+	std::vector<int> updates = {7, b + b / 2, b + b / 2 + 1, 3 * b - 1, 4 * b + 2};
+	{
+		file<int> f;
+		f.open(TMP_FILE, open_flags::no_compress | open_flags::no_readahead);
+#ifndef NDEBUG
+		int64_t written = get_total_bytes_written();
+#endif
+		{
+			auto s = f.stream();
+			for (int i : updates) {
+				s.seek(i);
+				s.write(-i);
+			}
+			// Appending to the last block writes it in full
+			s.seek(0, whence::end);
+			s.write(4 * b + 5);
+		}
+		f.close();
+#ifndef NDEBUG
+		// Only the pages of the updated items and the last block are written
+		int64_t page_size = sysconf(_SC_PAGESIZE);
+		ensure(true, get_total_bytes_written() - written < 6 * page_size + 8 * 1024, "bytes written");
+#endif
+	}
+
+	file<int> f;
+	f.open(TMP_FILE, open_flags::no_compress);
+	auto s = f.stream();
+	for (int i = 0; i < 4 * b + 6; i++) {
+		bool updated = std::find(updates.begin(), updates.end(), i) != updates.end();
+		ensure(updated? -i: i, s.read(), "read");
+	}
+
+	return EXIT_SUCCESS;
+}
+
+struct plain_item {
+	int64_t key;
+	char data[20];
+};
+
+int plain_serialized_test() {
+	static_assert(plain_serialized<plain_item, true>(), "plain_item should be trivially serializable");
+	int b;
+	std::vector<plain_item> items(1000);
+	{
+		serialized_file<plain_item> f;
+		f.open(TMP_FILE, compression_flag);
+		auto s = f.stream();
+		b = (int) s.logical_block_size();
+		plain_item item;
+		memset(&item, 0, sizeof item);
+		for (int i = 0; i < 3 * b + 10; i++) {
+			item.key = i;
+			item.data[i % 20] = char(i);
+			s.write(item);
+		}
+		for (int i = 0; i < 1000; i++) items[i].key = 3 * b + 10 + i;
+		s.write(items.data(), items.size());
+	}
+
+	serialized_file<plain_item> f;
+	f.open(TMP_FILE, compression_flag);
+	ensure<file_size_t>(3 * b + 1010, f.size(), "size");
+	auto s = f.stream();
+	for (int i = 0; i < 3 * b + 1010; i++) {
+		const plain_item & item = s.read();
+		ensure<int64_t>(i, item.key, "read");
+		if (i < 3 * b + 10) ensure(char(i), item.data[i % 20], "data");
+	}
+	for (int i = 3 * b + 1009; i >= 0; i--)
+		ensure<int64_t>(i, s.read_back().key, "read_back");
+
+	return EXIT_SUCCESS;
+}
+
+int read_async_test() {
+	file<int> f;
+	f.open(TMP_FILE, compression_flag);
+	std::vector<stream_position> positions;
+	int b;
+	{
+		auto s = f.stream();
+		b = (int) s.logical_block_size();
+		for (int i = 0; i < 20 * b + 17; i++) {
+			s.write(i);
+			if (i % b == 0) positions.push_back(s.get_position());
+		}
+	}
+	f.close();
+	f.open(TMP_FILE, compression_flag);
+
+	// Follow the blocks using next_position
+	{
+		int i = 0;
+		auto fut = f.read_async(f.stream().get_position());
+		while (true) {
+			fut.wait();
+			ensure(true, fut.ready(), "ready");
+			ensure<file_size_t>(i, fut.offset(), "offset");
+			for (block_size_t j = 0; j < fut.size(); j++, i++)
+				ensure(i, fut[j], "read");
+			if (fut.last()) break;
+			fut = f.read_async(fut.next_position());
+		}
+		ensure(20 * b + 17, i, "items");
+	}
+
+	// Read all blocks at once and count the callbacks
+	{
+		std::atomic<size_t> done(0);
+		std::vector<block_future<int, false>> futures;
+		for (auto & p : positions)
+			futures.push_back(f.read_async(p, [&done]() {done++;}));
+		for (size_t i = 0; i < futures.size(); i++) {
+			futures[i].wait();
+			ensure<file_size_t>(i * b, futures[i].offset(), "offset");
+			ensure(int(i) * b, futures[i][0], "read");
+		}
+		// wait returns once the callbacks have run
+		ensure(positions.size(), done.load(), "callbacks");
+
+		bool thrown = false;
+		try {
+			f.close();
+		} catch (exception &) {
+			thrown = true;
+		}
+		ensure(true, thrown, "close with futures");
+
+		// The close that threw left the file as it was
+		ensure(true, f.is_open(), "open after failed close");
+		auto s = f.stream();
+		for (int i = 0; i < 2 * b; i++) ensure(i, s.read(), "read after failed close");
+	}
+
+	// Dropping the futures waits for the callbacks, which may use what goes away after that
+	f.close();
+	f.open(TMP_FILE, compression_flag);
+	{
+		std::unique_ptr<std::atomic<size_t>> done(new std::atomic<size_t>(0));
+		std::vector<block_future<int, false>> futures;
+		for (auto & p : positions) {
+			std::atomic<size_t> * d = done.get();
+			futures.push_back(f.read_async(p, [d]() {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				(*d)++;
+			}));
+		}
+		futures.clear();
+		ensure(positions.size(), done->load(), "callbacks after reset");
+	}
+
+	return EXIT_SUCCESS;
+}
+
+struct sort_item {
+	uint64_t key;
+	char payload[248];
+};
+
+int external_sort_test() {
+	// Small memory and no readahead gives runs of ~24K items and a fan-in of 3,
+	// so sorting 150K items needs more than one merge pass
+	sort_options options;
+	options.memory = 4 * sizeof(block_base);
+	options.run_flags = open_flags::no_readahead | compression_flag;
+
+	const size_t N = 150000;
+	std::mt19937_64 rng(42);
+	std::string input_path = std::string(TMP_FILE) + ".in";
+	std::vector<uint64_t> keys;
+
+	{
+		file_stream<sort_item> in, out;
+		in.open(input_path, open_flags::truncate | compression_flag);
+		out.open(TMP_FILE, compression_flag);
+
+		sort_item item;
+		memset(&item, 0, sizeof item);
+		for (size_t i = 0; i < N; i++) {
+			item.key = rng();
+			keys.push_back(item.key);
+			in.write(item);
+		}
+
+		in.seek(0);
+		auto cmp = [](const sort_item & a, const sort_item & b) { return a.key > b.key; };
+		external_sort(in, out, cmp, options);
+
+		std::sort(keys.begin(), keys.end(), std::greater<uint64_t>());
+		ensure<file_size_t>(N, out.size(), "size");
+		out.seek(0);
+		for (size_t i = 0; i < N; i++)
+			ensure(keys[i], out.read().key, "read");
+	}
+
+	{
+		serialized_file_stream<std::string> in, out;
+		in.open(input_path, open_flags::truncate | compression_flag);
+		out.open(std::string(TMP_FILE) + ".out", open_flags::truncate | compression_flag);
+
+		std::vector<std::string> strings;
+		for (size_t i = 0; i < N; i++) {
+			strings.push_back(std::string(rng() % 200, 'a' + rng() % 26) + std::to_string(i));
+			in.write(strings.back());
+		}
+
+		in.seek(0);
+		external_sort(in, out, std::less<std::string>(), options);
+
+		std::sort(strings.begin(), strings.end());
+		out.seek(0);
+		for (size_t i = 0; i < N; i++)
+			ensure(strings[i], out.read(), "read");
+		ensure(false, out.can_read(), "can_read");
+	}
+
+	unlink(input_path.c_str());
+	unlink((std::string(TMP_FILE) + ".out").c_str());
+
+	return EXIT_SUCCESS;
+}
+
+int kway_merge_test() {
+	const size_t K = 37;
+	const size_t N = 200000;
+	std::mt19937_64 rng(7);
+
+	std::vector<std::vector<int>> inputs(K);
+	std::vector<int> expected;
+	for (size_t i = 0; i < N; i++) {
+		int v = rng() % 1000000;
+		inputs[rng() % K].push_back(v);
+		expected.push_back(v);
+	}
+	for (auto & in : inputs) std::sort(in.begin(), in.end());
+	std::sort(expected.begin(), expected.end());
+
+	// One file per input
+	{
+		std::vector<file_stream<int>> files(K);
+		for (size_t i = 0; i < K; i++) {
+			files[i].open(TMP_FILE "." + std::to_string(i), open_flags::truncate | compression_flag);
+			for (int v : inputs[i]) files[i].write(v);
+			files[i].seek(0);
+		}
+
+		file_stream<int> out;
+		out.open(TMP_FILE ".out", open_flags::truncate | compression_flag);
+
+		kway_merger<int> merger;
+		for (auto & f : files) merger.add_input(f);
+		merger.merge(out);
+
+		ensure<file_size_t>(N, out.size(), "size");
+		out.seek(0);
+		for (size_t i = 0; i < N; i++)
+			ensure(expected[i], out.read(), "read");
+
+		for (size_t i = 0; i < K; i++) {
+			files[i].close();
+			unlink((TMP_FILE "." + std::to_string(i)).c_str());
+		}
+		out.close();
+		unlink(TMP_FILE ".out");
+	}
+
+	// All inputs in one file with a stream per input
+	{
+		file<int> f;
+		f.open(TMP_FILE, compression_flag);
+		std::vector<stream_position> positions;
+		{
+			auto s = f.stream();
+			for (auto & in : inputs) {
+				positions.push_back(s.get_position());
+				s.write(in.data(), in.size());
+			}
+		}
+
+		file<int> out;
+		out.open(TMP_FILE ".out", open_flags::truncate | compression_flag);
+		auto o = out.stream();
+
+		std::vector<stream<int>> streams;
+		streams.reserve(K);
+		kway_merger<int> merger;
+		for (size_t i = 0; i < K; i++) {
+			streams.push_back(f.stream());
+			streams[i].set_position(positions[i]);
+			merger.add_input(streams[i], inputs[i].size());
+		}
+		merger.merge(o);
+
+		ensure<file_size_t>(N, out.size(), "size");
+		o.seek(0);
+		for (size_t i = 0; i < N; i++)
+			ensure(expected[i], o.read(), "read");
+	}
+
+	unlink(TMP_FILE ".out");
+
+	return EXIT_SUCCESS;
+}
+
+int partitioner_test() {
+	const size_t P = 300;
+	const size_t N = 200000;
+
+	std::vector<serialized_file<std::string>> files(P);
+	std::vector<serialized_file<std::string> *> outputs;
+	auto path = [](size_t i) {
+		return i == 0? std::string(TMP_FILE): TMP_FILE "." + std::to_string(i);
+	};
+	for (size_t i = 0; i < P; i++) {
+		files[i].open(path(i), open_flags::truncate | compression_flag);
+		outputs.push_back(&files[i]);
+	}
+
+	// Partition 0 already has an item, that must be kept
+	{
+		auto s = files[0].stream();
+		s.write("first");
+	}
+
+	partition_options options;
+	options.buffer_size = 4096;
+	options.max_open_streams = 8;
+
+	{
+		partitioner<std::string, true> p(outputs, options);
+		for (size_t i = 0; i < N; i++) {
+			p.write(i * i % P, std::to_string(i));
+		}
+		p.flush();
+	}
+
+	for (size_t i = 0; i < P; i++) {
+		auto s = files[i].stream();
+		if (i == 0) ensure<std::string>("first", s.read(), "read");
+		for (size_t j = 0; j < N; j++) {
+			if (j * j % P != i) continue;
+			ensure(std::to_string(j), s.read(), "read");
+		}
+		ensure(false, s.can_read(), "can_read");
+	}
+
+	for (size_t i = 1; i < P; i++) {
+		files[i].close();
+		unlink(path(i).c_str());
+	}
+
+	return EXIT_SUCCESS;
+}
+
+// Only whole blocks are written to the partitions, so with many more partitions than streams
+// the items are written about twice, to the spill file and their partition
+int partitioner_written_bytes() {
+	const size_t P = 8;
+	std::vector<file<int>> files(P);
+	std::vector<file<int> *> outputs;
+	auto path = [](size_t i) {
+		return i == 0? std::string(TMP_FILE): TMP_FILE "." + std::to_string(i);
+	};
+	for (size_t i = 0; i < P; i++) {
+		files[i].open(path(i), open_flags::truncate | compression_flag);
+		outputs.push_back(&files[i]);
+	}
+	const size_t N = P * files[0].stream().logical_block_size() * 3 / 2;
+
+	partition_options options;
+	options.buffer_size = 4096;
+	options.max_open_streams = 2;
+
+	// Random items, so the size on disk doesn't depend on compression
+	std::mt19937 rng(11);
+#ifndef NDEBUG
+	int64_t written = get_total_bytes_written();
+#endif
+	{
+		partitioner<int, false> p(outputs, options);
+		for (size_t i = 0; i < N; i++) p.write(i % P, int(rng()));
+		p.flush();
+	}
+	for (auto & f : files) f.close();
+
+	int64_t data = 0;
+	for (size_t i = 0; i < P; i++) {
+		struct stat st;
+		ensure(0, ::stat(path(i).c_str(), &st), "stat");
+		data += st.st_size;
+	}
+#ifndef NDEBUG
+	ensure(true, get_total_bytes_written() - written <= 3 * data, "bytes written");
+#endif
+	unused(data);
+
+	rng.seed(11);
+	std::vector<std::vector<int>> expected(P);
+	for (size_t i = 0; i < N; i++) expected[i % P].push_back(int(rng()));
+	for (size_t i = 0; i < P; i++) {
+		files[i].open(path(i), compression_flag);
+		auto s = files[i].stream();
+		for (int x : expected[i]) ensure(x, s.read(), "read");
+		ensure(false, s.can_read(), "can_read");
+	}
+
+	for (size_t i = 1; i < P; i++) {
+		files[i].close();
+		unlink(path(i).c_str());
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int staged_serialized() {
+	size_t initial_memory = pool_memory();
+	open_flags::open_flags flags = open_flags::stage_serialized | compression_flag;
+	std::mt19937 rng(42);
+	std::vector<std::string> strings;
+	auto next_string = [&]() {
+		// Every now and then a string big enough to not fit in the rest of a block
+		size_t size = strings.size() % 97 == 0? max_serialized_block_size() / 3: rng() % 200;
+		return std::string(size, char('a' + rng() % 26)) + std::to_string(strings.size());
+	};
+	auto check = [&](serialized_file<std::string> & f) {
+		ensure<file_size_t>(strings.size(), f.size(), "size");
+		auto s = f.stream();
+		for (size_t i = 0; i < strings.size(); i++)
+			ensure(strings[i], s.read(), "read");
+		for (size_t i = strings.size(); i-- > 0;)
+			ensure(strings[i], s.read_back(), "read_back");
+	};
+
+	stream_position p;
+	size_t p_items = 0;
+	{
+		serialized_file<std::string> f;
+		f.open(TMP_FILE, flags | open_flags::truncate);
+		auto s = f.stream();
+		for (int i = 0; i < 20000; i++) {
+			if (i == 12345) {
+				p = s.get_position();
+				p_items = strings.size();
+			}
+			strings.push_back(next_string());
+			s.write(strings.back());
+		}
+	}
+
+	serialized_file<std::string> f;
+	f.open(TMP_FILE, flags);
+	check(f);
+
+	// The last block was not staged when it was read back
+	{
+		auto s = f.stream();
+		s.seek(0, whence::end);
+		for (int i = 0; i < 5000; i++) {
+			strings.push_back(next_string());
+			s.write(strings.back());
+		}
+	}
+	check(f);
+
+	f.truncate(p);
+	strings.resize(p_items);
+	{
+		auto s = f.stream();
+		s.seek(0, whence::end);
+		for (int i = 0; i < 5000; i++) {
+			strings.push_back(next_string());
+			s.write(strings.back());
+		}
+	}
+	check(f);
+	f.close();
+
+	f.open(TMP_FILE, compression_flag);
+	check(f);
+	f.close();
+
+	// Blocks keep their staged bytes when a file that doesn't stage takes them,
+	// so passing them back and forth doesn't allocate them again
+	size_t staged_memory = pool_memory();
+	ensure(true, staged_memory > initial_memory, "staged bytes");
+	{
+		f.open(TMP_FILE, compression_flag | open_flags::truncate);
+		auto s = f.stream();
+		for (const std::string & x : strings) s.write(x);
+	}
+	f.close();
+	ensure(staged_memory, pool_memory(), "staged bytes kept");
+
+	return EXIT_SUCCESS;
+}
+
+template <typename T>
+int integer_codec_items(const std::vector<T> & items) {
+	{
+		file<T> f;
+		f.open(TMP_FILE, open_flags::integer_codec | open_flags::truncate | compression_flag);
+		auto s = f.stream();
+		s.write(const_cast<T *>(items.data()), items.size());
+	}
+
+	// The file decides the codec
+	file<T> f;
+	f.open(TMP_FILE, compression_flag);
+	ensure<file_size_t>(items.size(), f.size(), "size");
+	auto s = f.stream();
+	for (size_t i = 0; i < items.size(); i++)
+		ensure(items[i], s.read(), "read");
+	for (size_t i = items.size(); i-- > 0;)
+		ensure(items[i], s.read_back(), "read_back");
+	return EXIT_SUCCESS;
+}
+
+int integer_codec() {
+	std::mt19937_64 rng(42);
+	size_t n = 3 * block_size() / sizeof(int64_t) + 1234;
+
+	// Sorted keys with small gaps, a run of equal keys and a big jump
+	std::vector<int64_t> sorted(n);
+	int64_t k = -1000000;
+	for (size_t i = 0; i < n; i++) {
+		if (i < n / 3 || i > n / 2) k += rng() % 16;
+		if (i == 2 * n / 3) k += int64_t(1) << 50;
+		sorted[i] = k;
+	}
+	if (integer_codec_items(sorted)) return EXIT_FAILURE;
+
+	if (!(compression_flag & open_flags::no_compress)) {
+		struct stat st;
+		stat(TMP_FILE, &st);
+		if ((size_t)st.st_size > n * sizeof(int64_t) / 4) {
+			std::cout << "Sorted keys compressed to " << st.st_size << " bytes" << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	// Random values use all the bits and wrap around
+	std::vector<uint64_t> random(n);
+	for (auto & x : random) x = rng();
+	if (integer_codec_items(random)) return EXIT_FAILURE;
+
+	// Frames of deltas of every bit width, to reach each frame unpacker
+	std::vector<uint64_t> widths(n);
+	for (size_t i = 1; i < n; i++) {
+		unsigned bits = (i - 1) / integer_frame_size() % 65;
+		uint64_t mask = bits == 64? ~uint64_t(0): (uint64_t(1) << bits) - 1;
+		uint64_t d = rng() & mask;
+		if ((i - 1) % integer_frame_size() == 0) d = 0;
+		if ((i - 1) % integer_frame_size() == 1) d = mask;
+		widths[i] = widths[i - 1] + d;
+	}
+	if (integer_codec_items(widths)) return EXIT_FAILURE;
+
+	std::vector<int8_t> small(n);
+	for (size_t i = 0; i < n; i++) small[i] = int8_t(i % 7 == 0? rng(): i);
+	if (integer_codec_items(small)) return EXIT_FAILURE;
+
+	std::vector<uint32_t> descending(n);
+	for (size_t i = 0; i < n; i++) descending[i] = uint32_t(n - i) * 3;
+	if (integer_codec_items(descending)) return EXIT_FAILURE;
+
+	// Only integers can use the codec
+	file<double> f;
+	try {
+		f.open(TMP_FILE, open_flags::integer_codec | open_flags::truncate);
+	} catch (exception &) {
+		return EXIT_SUCCESS;
+	}
+	std::cout << "Opened a file of doubles with the integer codec" << std::endl;
+	return EXIT_FAILURE;
+}
+
+struct three_bytes {
+	unsigned char b[3];
+};
+
+template <typename T, bool serialized>
+int byte_shuffle_items(const std::vector<T> & items) {
+	{
+		file_base<T, serialized> f;
+		f.open(TMP_FILE, open_flags::byte_shuffle | open_flags::truncate | compression_flag);
+		auto s = f.stream();
+		for (const T & item : items) s.write(item);
+	}
+
+	// The file decides whether it is shuffled
+	file_base<T, serialized> f;
+	f.open(TMP_FILE, compression_flag);
+	ensure<file_size_t>(items.size(), f.size(), "size");
+	auto s = f.stream();
+	for (size_t i = 0; i < items.size(); i++)
+		ensure(0, memcmp(&items[i], &s.read(), sizeof(T)), "read");
+	for (size_t i = items.size(); i-- > 0;)
+		ensure(0, memcmp(&items[i], &s.read_back(), sizeof(T)), "read_back");
+	return EXIT_SUCCESS;
+}
+
+int byte_shuffle() {
+	std::mt19937 rng(42);
+
+	// Sizes with their own kernels and sizes transposed 8 or 16 bytes at a time,
+	// with counts that leave items for the generic loop, and fewer items than a group
+	for (size_t item_size : {2, 3, 4, 8, 16, 24, 32, 40}) {
+		for (size_t items : {0, 1, 7, 13, 255, 257, 1000, 4096 + 11}) {
+			std::string name = std::to_string(item_size) + " byte items x " + std::to_string(items);
+			std::vector<char> in(items * item_size), shuffled(in.size()), out(in.size());
+			for (char & c : in) c = char(rng());
+			shuffle(in.data(), items, item_size, shuffled.data());
+			bool moved = true;
+			for (size_t i = 0; i < items; i++)
+				for (size_t k = 0; k < item_size; k++)
+					moved = moved && shuffled[k * items + i] == in[i * item_size + k];
+			ensure(true, moved, ("shuffled " + name).c_str());
+			unshuffle(shuffled.data(), items, item_size, out.data());
+			ensure(true, in == out, ("unshuffled " + name).c_str());
+		}
+	}
+
+	std::vector<plain_item> plain(3 * block_size() / sizeof(plain_item) + 17);
+	for (size_t i = 0; i < plain.size(); i++) {
+		memset(&plain[i], 0, sizeof(plain_item));
+		plain[i].key = i;
+		plain[i].data[i % 20] = char(rng());
+	}
+	if (byte_shuffle_items<plain_item, false>(plain)) return EXIT_FAILURE;
+	if (byte_shuffle_items<plain_item, true>(plain)) return EXIT_FAILURE;
+
+	std::vector<three_bytes> odd(3 * block_size() / sizeof(three_bytes) + 1);
+	for (size_t i = 0; i < odd.size(); i++)
+		odd[i] = three_bytes{{(unsigned char)i, (unsigned char)(i >> 8), (unsigned char)rng()}};
+	if (byte_shuffle_items<three_bytes, true>(odd)) return EXIT_FAILURE;
+
+	// Serialized items are not stored as their bytes
+	if (compression_flag & open_flags::no_compress) return EXIT_SUCCESS;
+	serialized_file<std::string> f;
+	try {
+		f.open(TMP_FILE, open_flags::byte_shuffle | open_flags::truncate);
+	} catch (exception &) {
+		return EXIT_SUCCESS;
+	}
+	std::cout << "Opened a file of strings with byte shuffling" << std::endl;
+	return EXIT_FAILURE;
+}
+
+// Reads the file of items 0, 1, ... and returns the number of items read before an exception
+template <typename F>
+file_size_t read_until_error(F & f, bool & thrown) {
+	auto s = f.stream();
+	file_size_t i = 0;
+	thrown = false;
+	try {
+		for (; i < f.size(); i++)
+			if (s.read() != int(i)) break;
+	} catch (exception &) {
+		thrown = true;
+	}
+	return i;
+}
+
+int block_checksums() {
+	file_size_t n;
+	{
+		file<int> f;
+		f.open(TMP_FILE, open_flags::checksum | open_flags::truncate | compression_flag);
+		auto s = f.stream();
+		n = 3 * s.logical_block_size() + 5;
+		for (file_size_t i = 0; i < n; i++) s.write(int(i));
+	}
+
+	// The file decides whether it has checksums
+	bool thrown;
+	{
+		file<int> f;
+		f.open(TMP_FILE, compression_flag);
+		ensure(n, read_until_error(f, thrown), "read");
+		ensure(false, thrown, "thrown");
+	}
+
+	// Damage a byte in the middle of the file, which is in the payload of a block after the first
+	struct stat st;
+	ensure(0, stat(TMP_FILE, &st), "stat");
+	off_t off = st.st_size / 2;
+	int fd = ::open(TMP_FILE, O_RDWR);
+	char c, d;
+	ensure<ssize_t>(1, pread(fd, &c, 1, off), "pread");
+	d = char(c ^ 0x10);
+	ensure<ssize_t>(1, pwrite(fd, &d, 1, off), "pwrite");
+
+	{
+		file<int> f;
+		f.open(TMP_FILE, compression_flag);
+		file_size_t i = read_until_error(f, thrown);
+		ensure(true, thrown, "thrown");
+		ensure(true, i > 0 && i < n, "items before error");
+
+		// The error is also raised when waiting for the block in the background
+		auto fut = f.read_async(f.stream().get_position());
+		thrown = false;
+		try {
+			while (true) {
+				fut.wait();
+				if (fut.last()) break;
+				fut = f.read_async(fut.next_position());
+			}
+		} catch (exception &) {
+			thrown = true;
+		}
+		ensure(true, thrown, "thrown by future");
+	}
+
+	ensure<ssize_t>(1, pwrite(fd, &c, 1, off), "pwrite");
+	::close(fd);
+
+	file<int> f;
+	f.open(TMP_FILE, compression_flag);
+	ensure(n, read_until_error(f, thrown), "read repaired");
+	ensure(false, thrown, "thrown");
+	return EXIT_SUCCESS;
+}
+
+// Opens path read only until it has at least n items, which happens when the writer reaches a checkpoint
+file_size_t wait_for_checkpoint(const std::string & path, file_size_t n) {
+	for (int tries = 0; tries < 10000; tries++) {
+		file<int> r;
+		r.open(path, open_flags::read_only | compression_flag);
+		if (r.size() >= n) return r.size();
+		r.close();
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return 0;
+}
+
+int checkpoint_reopen() {
+	const std::string copy = TMP_FILE ".crash";
+	file<int> f;
+	f.open(TMP_FILE, open_flags::truncate | compression_flag);
+	file_size_t b, n;
+	{
+		auto s = f.stream();
+		b = s.logical_block_size();
+		n = (checkpoint_blocks() + 3) * b + 7;
+		for (file_size_t i = 0; i < n; i++) s.write(int(i));
+
+		// A reader sees the blocks up to the last checkpoint while the file is written
+		ensure(checkpoint_blocks() * b, wait_for_checkpoint(TMP_FILE, checkpoint_blocks() * b), "checkpoint size");
+		{
+			file<int> r;
+			r.open(TMP_FILE, open_flags::read_only | compression_flag);
+			auto rs = r.stream();
+			for (file_size_t i = 0; i < r.size(); i++)
+				ensure(int(i), rs.read(), "read while writing");
+		}
+
+		// Copying the file now is like crashing, as the header was not written on close
+		std::ifstream in(TMP_FILE, std::ios::binary);
+		std::ofstream out(copy, std::ios::binary | std::ios::trunc);
+		out << in.rdbuf();
+	}
+	f.close();
+
+	{
+		file<int> c;
+		c.open(copy, compression_flag);
+		ensure(checkpoint_blocks() * b, c.size(), "size after crash");
+		auto s = c.stream();
+		for (file_size_t i = 0; i < checkpoint_blocks() * b; i++)
+			ensure(int(i), s.read(), "read after crash");
+		// The blocks after the checkpoint were cut off, so we can write from there
+		for (file_size_t i = checkpoint_blocks() * b; i < n; i++) s.write(int(i));
+	}
+	{
+		file<int> c;
+		c.open(copy, compression_flag);
+		ensure(n, c.size(), "size after rewrite");
+		auto s = c.stream();
+		for (file_size_t i = 0; i < n; i++)
+			ensure(int(i), s.read(), "read after rewrite");
+	}
+	if (!check_file(copy.c_str())) return EXIT_FAILURE;
+	unlink(copy.c_str());
+
+	f.open(TMP_FILE, compression_flag);
+	ensure(n, f.size(), "size");
+	return EXIT_SUCCESS;
+}
+
+int concurrent_readers() {
+	file_size_t n;
+	{
+		file<int> f;
+		f.open(TMP_FILE, open_flags::truncate | compression_flag);
+		auto s = f.stream();
+		n = 20 * s.logical_block_size() + 11;
+		for (file_size_t i = 0; i < n; i++) s.write(int(i));
+	}
+
+	file<int> f;
+	f.open(TMP_FILE, open_flags::read_only | compression_flag);
+
+	// Each thread scans the file with its own streams, half of them backwards
+	const int threads = 8;
+	std::atomic<int> failures(0);
+	std::vector<std::thread> readers;
+	for (int t = 0; t < threads; t++) {
+		readers.emplace_back([&f, &failures, n, t]() {
+			for (int round = 0; round < 3; round++) {
+				auto s = f.stream();
+				if (t % 2 == 0) {
+					for (file_size_t i = 0; s.can_read(); i++)
+						if (s.read() != int(i)) failures++;
+					if (s.offset() != n) failures++;
+				} else {
+					s.seek(0, whence::end);
+					for (file_size_t i = n; s.can_read_back();)
+						if (s.read_back() != int(--i)) failures++;
+				}
+			}
+		});
+	}
+	for (auto & r : readers) r.join();
+	ensure(0, failures.load(), "failures");
+
+	return EXIT_SUCCESS;
+}
+
+int parallel_scan() {
+	const file_size_t blocks = 21;
+	file_size_t n, block_items;
+	{
+		file<int> f;
+		f.open(TMP_FILE, open_flags::truncate | compression_flag);
+		auto s = f.stream();
+		block_items = s.logical_block_size();
+		n = (blocks - 1) * block_items + 11;
+		for (file_size_t i = 0; i < n; i++) s.write(int(i));
+
+		// Writable files are scanned by the calling thread
+		ensure(n, parallel_reduce(f, file_size_t(0), [](file_size_t c, int) {return c + 1;}, std::plus<file_size_t>(), 4), "writable count");
+	}
+
+	file<int> f;
+	f.open(TMP_FILE, open_flags::read_only | compression_flag);
+
+	auto positions = f.block_positions();
+	ensure(blocks, positions.size(), "blocks");
+	for (file_size_t i = 0; i < blocks; i++) {
+		ensure(i, positions[i].m_block, "block");
+		ensure(i * block_items, positions[i].m_logical_offset, "logical offset");
+	}
+
+	for (size_t threads : {1, 3, 8, 32}) {
+		auto sum = parallel_reduce(f, int64_t(0), [](int64_t s, int x) {return s + x;}, std::plus<int64_t>(), threads);
+		ensure(int64_t(n) * int64_t(n - 1) / 2, sum, "sum");
+
+		// Ranges are combined in file order
+		typedef std::pair<int64_t, int64_t> range;
+		auto r = parallel_reduce(f, range(-1, -1), [](range r, int x) {
+			if (r.first == -1) return range(x, x);
+			return range(r.first, r.second + 1 == x? x: -2);
+		}, [](range a, range b) {
+			return range(a.first, a.second + 1 == b.first? b.second: -2);
+		}, threads);
+		ensure(int64_t(0), r.first, "first");
+		ensure(int64_t(n - 1), r.second, "last");
+
+		std::atomic<file_size_t> count(0);
+		parallel_for_each(f, [&count](int) {count++;}, threads);
+		ensure(n, count.load(), "count");
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int parallel_scan_serialized() {
+	file_size_t n = 200000, length = 0;
+	{
+		serialized_file<std::string> f;
+		f.open(TMP_FILE, open_flags::truncate | compression_flag);
+		auto s = f.stream();
+		for (file_size_t i = 0; i < n; i++) {
+			std::string x = std::to_string(i);
+			length += x.size();
+			s.write(x);
+		}
+	}
+
+	serialized_file<std::string> f;
+	f.open(TMP_FILE, open_flags::read_only | compression_flag);
+
+	auto positions = f.block_positions();
+	ensure(true, positions.size() > 1, "several blocks");
+	for (size_t i = 0; i < positions.size(); i++) {
+		auto s = f.stream();
+		s.set_position(positions[i]);
+		ensure(std::to_string(positions[i].m_logical_offset), s.read(), "first item");
+	}
+
+	auto total = parallel_reduce(f, file_size_t(0), [](file_size_t l, const std::string & x) {return l + x.size();}, std::plus<file_size_t>(), 4);
+	ensure(length, total, "length");
+
+	return EXIT_SUCCESS;
+}
+
+#ifndef NDEBUG
+int64_t get_total_helped_chunks();
+#endif
+
+int parallel_decompress() {
+	file_size_t n;
+	{
+		file<int> f;
+		f.open(TMP_FILE, open_flags::truncate | compression_flag);
+		auto s = f.stream();
+		n = 6 * s.logical_block_size() + 11;
+		for (file_size_t i = 0; i < n; i++) s.write(int(i * 7));
+	}
+
+	// Reads the file on this thread, returning the chunks that helpers decompressed meanwhile
+	auto read_all = [&]() {
+#ifndef NDEBUG
+		int64_t helped = get_total_helped_chunks();
+#endif
+		{
+			file<int> f;
+			f.open(TMP_FILE, open_flags::no_readahead | compression_flag);
+			auto s = f.stream();
+			for (file_size_t i = 0; i < n; i++) ensure(int(i * 7), s.read(), "read");
+			ensure(false, s.can_read(), "can_read");
+		}
+#ifndef NDEBUG
+		return get_total_helped_chunks() - helped;
+#else
+		return int64_t(0);
+#endif
+	};
+
+	// The only job thread is kept busy by a read callback, so the reader decompresses every chunk itself
+	file_stream_term();
+	file_stream_init(1);
+	std::string path = std::string(TMP_FILE) + ".busy";
+	{
+		file<int> busy;
+		busy.open(path, open_flags::truncate | compression_flag);
+		{
+			auto s = busy.stream();
+			for (int i = 0; i < 10; i++) s.write(i);
+		}
+		busy.close();
+		busy.open(path, compression_flag);
+
+		std::atomic_bool started(false), release(false);
+		auto fut = busy.read_async(busy.stream().get_position(), [&]() {
+			started = true;
+			while (!release) std::this_thread::yield();
+		});
+		while (!started) std::this_thread::yield();
+		int64_t helped = read_all();
+		release = true;
+		fut.wait();
+		ensure<int64_t>(0, helped, "helped chunks with a busy job thread");
+	}
+	::unlink(path.c_str());
+
+	// The other job threads are idle while this one reads, so they help with the chunks
+	file_stream_term();
+	file_stream_init(4);
+	int64_t helped = read_all();
+#ifndef NDEBUG
+	if (!(compression_flag & open_flags::no_compress)) ensure(true, helped > 0, "helped chunks");
+#endif
+	unused(helped);
+
+	return EXIT_SUCCESS;
+}
+
+int async_close() {
+	const int files = 16;
+	std::vector<std::string> paths;
+	for (int i = 0; i < files; i++)
+		paths.push_back(std::string(TMP_FILE) + "." + std::to_string(i));
+
+	file_size_t n;
+	{
+		std::vector<file<int>> fs(files);
+		std::vector<file_base_base *> ptrs;
+		for (int i = 0; i < files; i++) {
+			fs[i].open(paths[i], open_flags::truncate | compression_flag);
+			auto s = fs[i].stream();
+			n = 2 * s.logical_block_size() + 3;
+			for (file_size_t j = 0; j < n; j++) s.write(int(j) + i);
+			ptrs.push_back(&fs[i]);
+		}
+
+		// A flush finishes once the blocks written so far are on disk
+		io_future flushed = fs[0].flush_async();
+		flushed.wait();
+		ensure(true, flushed.ready(), "flushed");
+
+		// The file can be reused right away, while the old file is finished in the background
+		io_future closed = fs[1].close_async();
+		ensure(false, fs[1].is_open(), "is_open");
+		fs[1].open(TMP_FILE, open_flags::truncate | compression_flag);
+		fs[1].stream().write(42);
+		closed.wait();
+
+		ptrs.erase(ptrs.begin() + 1);
+		close_all(ptrs);
+		for (auto p : ptrs) ensure(false, p->is_open(), "is_open");
+	}
+
+	for (int i = 0; i < files; i++) {
+		file<int> f;
+		f.open(paths[i], open_flags::read_only | compression_flag);
+		ensure(n, f.size(), "size");
+		{
+			auto s = f.stream();
+			for (file_size_t j = 0; j < n; j++) ensure(int(j) + i, s.read(), "read");
+		}
+		f.close_async().wait();
+		::unlink(paths[i].c_str());
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int group_sync() {
+	const int files = 8;
+	std::vector<std::string> paths;
+	// The first file is checked after the test
+	paths.push_back(TMP_FILE);
+	for (int i = 1; i < files; i++)
+		paths.push_back(std::string(TMP_FILE) + "." + std::to_string(i));
+
+	std::vector<file<int>> fs(files);
+	std::vector<file_base_base *> ptrs;
+	for (int i = 0; i < files; i++) {
+		fs[i].open(paths[i], open_flags::truncate | compression_flag);
+		ptrs.push_back(&fs[i]);
+	}
+	file_size_t bs = fs[0].stream().logical_block_size();
+
+	// The files are synced by their own threads at the same time, with the last block held by the stream
+	std::vector<std::thread> writers;
+	for (int i = 0; i < files; i++) {
+		writers.emplace_back([&fs, bs, i]() {
+			auto s = fs[i].stream();
+			for (file_size_t j = 0; j < 2 * bs + 3; j++) s.write(int(j) + i);
+			fs[i].sync();
+		});
+	}
+	for (auto & w : writers) w.join();
+
+	// The header on disk counts the synced blocks
+	for (int i = 0; i < files; i++) {
+		file<int> f;
+		f.open(paths[i], open_flags::read_only | compression_flag);
+		ensure(2 * bs, f.size(), "synced size");
+		auto s = f.stream();
+		for (file_size_t j = 0; j < 2 * bs; j++) ensure(int(j) + i, s.read(), "read");
+	}
+
+	sync_all(ptrs);
+
+	// Syncs running while checkpoints are due, the header on disk is the one of the last sync
+	file_size_t more = checkpoint_blocks() * bs;
+	{
+		auto s = fs[1].stream();
+		s.seek(0, whence::end);
+		std::vector<io_future> syncs;
+		for (file_size_t j = 0; j < more; j++) {
+			s.write(int(j));
+			if (j % (bs / 2) == 0) syncs.push_back(fs[1].sync_async());
+		}
+		for (auto & sync : syncs) sync.wait();
+
+		file<int> f;
+		f.open(paths[1], open_flags::read_only | compression_flag);
+		ensure(0, int(f.size() % bs), "synced blocks");
+		ensure(true, f.size() >= more, "synced size after checkpoints");
+	}
+
+	for (int i = 0; i < files; i++) {
+		fs[i].close();
+		file<int> f;
+		f.open(paths[i], open_flags::read_only | compression_flag);
+		ensure(2 * bs + 3 + (i == 1? more: 0), f.size(), "size");
+		// A read only file has nothing to sync
+		f.sync();
+		f.close();
+		if (i != 0) ::unlink(paths[i].c_str());
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int temporary_file() {
+	std::string dir = "/tmp";
+	file_size_t n;
+	{
+		file<int> f;
+		f.open(dir, open_flags::temporary | compression_flag, sizeof(int));
+		ensure(true, f.is_writable(), "is_writable");
+		int magic = 1234;
+		f.write_user_data(magic);
+		{
+			auto s = f.stream();
+			n = 3 * s.logical_block_size() + 7;
+			for (file_size_t i = 0; i < n; i++) s.write(int(i));
+			s.seek(0);
+			for (file_size_t i = 0; i < n; i++) ensure(int(i), s.read(), "read");
+		}
+		magic = 0;
+		f.read_user_data(magic);
+		ensure(1234, magic, "user data");
+		f.sync();
+
+		// Copy the temporary file to a real file, which is checked after the test
+		file<int> out;
+		out.open(TMP_FILE, open_flags::truncate | compression_flag);
+		auto in = f.stream();
+		auto o = out.stream();
+		while (in.can_read()) o.write(in.read());
+	}
+
+	file<int> f;
+	f.open(TMP_FILE, open_flags::read_only | compression_flag);
+	ensure(n, f.size(), "size");
+
+	bool failed = false;
+	try {
+		file<int> g;
+		g.open(dir, open_flags::temporary | open_flags::read_only);
+	} catch (exception &) {
+		failed = true;
+	}
+	ensure(true, failed, "read only temporary file");
+
+	return EXIT_SUCCESS;
+}
+
+// Bytes of disk space used by path
+file_size_t allocated_size(const std::string & path) {
+	struct stat st;
+	::stat(path.c_str(), &st);
+	return file_size_t(st.st_blocks) * 512;
+}
+
+file_size_t file_size_on_disk(const std::string & path) {
+	struct stat st;
+	::stat(path.c_str(), &st);
+	return st.st_size;
+}
+
+// Whether the file system of path can allocate space past the end of a file,
+// tmpfs and some others can't, and st_blocks says nothing about preallocation there
+bool keep_size_fallocate(const std::string & path) {
+	std::string probe = path + ".probe";
+	int fd = ::open(probe.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return false;
+	int r = ::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, 64 * 1024);
+	::close(fd);
+	::unlink(probe.c_str());
+	return r == 0;
+}
+
+int preallocation() {
+	bool supported = keep_size_fallocate(TMP_FILE);
+	if (!supported) log_info() << "fallocate with FALLOC_FL_KEEP_SIZE is not supported, only checking the items" << std::endl;
+
+	file_size_t n;
+	{
+		file<int> f;
+		f.open(TMP_FILE, open_flags::truncate | compression_flag);
+		{
+			auto s = f.stream();
+			n = 2 * s.logical_block_size() + 3;
+			for (file_size_t i = 0; i < n; i++) s.write(int(i));
+			f.flush_async().wait();
+
+			// Space past the blocks written is allocated, but the size is not changed.
+			// It was allocated when the first block was written, so the second block used some of it.
+			if (supported)
+				ensure(true, allocated_size(TMP_FILE) >= file_size_on_disk(TMP_FILE) + default_preallocation() / 2, "preallocated");
+		}
+		f.close();
+		if (supported)
+			ensure(true, allocated_size(TMP_FILE) < file_size_on_disk(TMP_FILE) + 64 * 1024, "trimmed at close");
+	}
+
+	std::string path = std::string(TMP_FILE) + ".reserved";
+	{
+		file<int> f;
+		f.open(path, open_flags::truncate | compression_flag);
+		f.reserve(4 * default_preallocation());
+		if (supported) ensure(true, allocated_size(path) >= 4 * default_preallocation(), "reserved");
+
+		stream_position middle;
+		{
+			auto s = f.stream();
+			for (file_size_t i = 0; i < n; i++) {
+				if (i == n / 2) middle = s.get_position();
+				s.write(int(i));
+			}
+		}
+
+		// Without preallocation only the blocks written take up space,
+		// and truncating releases the space reserved
+		f.set_preallocation(0);
+		f.truncate(middle);
+		f.flush_async().wait();
+		if (supported) ensure(true, allocated_size(path) < file_size_on_disk(path) + 64 * 1024, "trimmed at truncate");
+
+		{
+			auto s = f.stream();
+			s.seek(0, whence::end);
+			for (file_size_t i = 0; i < n; i++) s.write(int(i));
+		}
+		f.flush_async().wait();
+		if (supported) ensure(true, allocated_size(path) < file_size_on_disk(path) + 64 * 1024, "not preallocated");
+		f.close();
+
+		f.open(path, open_flags::read_only | compression_flag);
+		ensure(n / 2 + n, f.size(), "reserved size");
+		auto s = f.stream();
+		for (file_size_t i = 0; i < n / 2; i++) ensure(int(i), s.read(), "reserved read");
+		for (file_size_t i = 0; i < n; i++) ensure(int(i), s.read(), "reserved read appended");
+	}
+	::unlink(path.c_str());
+
+	file<int> f;
+	f.open(TMP_FILE, open_flags::read_only | compression_flag);
+	ensure(n, f.size(), "size");
+	auto s = f.stream();
+	for (file_size_t i = 0; i < n; i++) ensure(int(i), s.read(), "read");
+
+	return EXIT_SUCCESS;
+}
+
+int in_memory_file() {
+	std::mt19937 rng(7);
+	std::vector<int> items;
+	{
+		file<int> f;
+		f.open("/tmp", open_flags::in_memory | compression_flag);
+		ensure(true, f.in_memory(), "in memory");
+
+		auto s = f.stream();
+		for (file_size_t i = 0; i < 3 * s.logical_block_size(); i++) {
+			items.push_back(int(rng()));
+			s.write(items.back());
+		}
+		f.flush_async().wait();
+		ensure(true, f.in_memory(), "small file in memory");
+
+		// Random items don't compress, so the file is moved to disk once it has grown past the limit
+		while (items.size() * sizeof(int) <= max_in_memory_file_size() + 2 * block_size()) {
+			items.push_back(int(rng()));
+			s.write(items.back());
+		}
+		f.flush_async().wait();
+		ensure(false, f.in_memory(), "big file in memory");
+
+		s.seek(0);
+		for (size_t i = 0; i < items.size(); i++) ensure(items[i], s.read(), "read");
+		ensure(false, s.can_read(), "can_read");
+
+		// Copy some of the file to a real file, which is checked after the test
+		file<int> out;
+		out.open(TMP_FILE, open_flags::truncate | compression_flag);
+		auto o = out.stream();
+		s.seek(0);
+		for (size_t i = 0; i < 1000; i++) o.write(s.read());
+	}
+
+	// Writing user data and preallocation set in memory while the file is moved to disk
+	{
+		file<int> f;
+		f.open("/tmp", open_flags::in_memory | compression_flag, sizeof(int));
+		f.set_preallocation(0);
+		auto s = f.stream();
+		for (size_t i = 0; i < items.size(); i++) {
+			s.write(items[i]);
+			if (i % s.logical_block_size() == 0) {
+				int user_data = int(i);
+				f.write_user_data(&user_data, sizeof(int));
+			}
+		}
+		f.flush_async().wait();
+		ensure(false, f.in_memory(), "moved to disk");
+
+		int user_data = 0;
+		f.read_user_data(&user_data, sizeof(int));
+		ensure<int>(int((items.size() - 1) / s.logical_block_size() * s.logical_block_size()), user_data, "user data");
+		s.seek(0);
+		for (size_t i = 0; i < items.size(); i++) ensure(items[i], s.read(), "read moved");
+	}
+
+	return EXIT_SUCCESS;
+}
+
+#ifndef NDEBUG
+int64_t get_total_blocks_read();
+#endif
+
+int shared_block_cache() {
+	file_size_t n;
+	{
+		file<int> f;
+		f.open(TMP_FILE, open_flags::truncate | compression_flag);
+		auto s = f.stream();
+		n = 4 * s.logical_block_size();
+		for (file_size_t i = 0; i < n; i++) s.write(int(i));
+	}
+
+	auto scan = [](file<int> & f, file_size_t n) {
+		auto s = f.stream();
+		for (file_size_t i = 0; i < n; i++) ensure(int(i), s.read(), "read");
+		ensure(false, s.can_read(), "can_read");
+	};
+
+	{
+		file<int> a;
+		a.open(TMP_FILE, open_flags::read_only | compression_flag);
+		scan(a, n);
+#ifndef NDEBUG
+		int64_t read = get_total_blocks_read();
+#endif
+		// The blocks read by a are used by b
+		file<int> b;
+		b.open(TMP_FILE, open_flags::read_only | compression_flag);
+		scan(b, n);
+#ifndef NDEBUG
+		ensure(read, get_total_blocks_read(), "blocks read by second file");
+#endif
+	}
+
+	{
+		// And they are kept when both files are closed
+#ifndef NDEBUG
+		int64_t read = get_total_blocks_read();
+#endif
+		file<int> f;
+		f.open(TMP_FILE, open_flags::read_only | compression_flag);
+		scan(f, n);
+#ifndef NDEBUG
+		ensure(read, get_total_blocks_read(), "blocks read by reopened file");
+#endif
+	}
+
+	{
+		// Writing the file changes its identity, so the cached blocks are not used
+		file<int> f;
+		f.open(TMP_FILE, compression_flag);
+		auto s = f.stream();
+		s.seek(0, whence::end);
+		s.write(int(n));
+	}
+
+	file<int> f;
+	f.open(TMP_FILE, open_flags::read_only | compression_flag);
+	scan(f, n + 1);
+
+	return EXIT_SUCCESS;
+}
+
+#ifndef NDEBUG
+int64_t get_total_borrowed_blocks();
+int64_t get_total_quota_waits();
+#endif
+
+int fair_block_sharing() {
+	const int runs = 16;
+	std::string merge_path = std::string(TMP_FILE) + ".merge";
+	std::string out_path = std::string(TMP_FILE) + ".out";
+	file_size_t bs;
+	std::vector<stream_position> starts;
+	{
+		file<int> f;
+		f.open(TMP_FILE, open_flags::truncate | compression_flag);
+		auto s = f.stream();
+		bs = s.logical_block_size();
+		for (file_size_t i = 0; i < 8 * bs; i++) s.write(int(i));
+	}
+	{
+		file<int> f;
+		f.open(merge_path, open_flags::truncate | compression_flag);
+		auto s = f.stream();
+		for (file_size_t i = 0; i < runs * 2 * bs; i++) {
+			if (i % (2 * bs) == 0) starts.push_back(s.get_position());
+			s.write(int(i));
+		}
+	}
+
+#ifndef NDEBUG
+	int64_t waits = get_total_quota_waits();
+#endif
+
+	// A wide merge with a stream for each run, writing to another file, ...
+	std::thread merge([&]() {
+		file<int> in;
+		in.open(merge_path, open_flags::read_only | compression_flag);
+		file<int> out;
+		out.open(out_path, open_flags::truncate | compression_flag);
+		std::vector<stream<int>> ss;
+		for (int r = 0; r < runs; r++) {
+			ss.push_back(in.stream());
+			ss.back().set_position(starts[r]);
+		}
+		auto o = out.stream();
+		for (file_size_t i = 0; i < 2 * bs; i++)
+			for (auto & s : ss) o.write(s.read());
+	});
+
+	// ... doesn't keep a scan of another file from getting its blocks
+	{
+		file<int> f;
+		f.open(TMP_FILE, open_flags::read_only | compression_flag);
+		for (int k = 0; k < 4; k++) {
+			auto s = f.stream();
+			for (file_size_t i = 0; i < 8 * bs; i++) ensure(int(i), s.read(), "read");
+		}
+	}
+	merge.join();
+
+	{
+		file<int> out;
+		out.open(out_path, open_flags::read_only | compression_flag);
+		auto s = out.stream();
+		for (file_size_t i = 0; i < 2 * bs; i++)
+			for (int r = 0; r < runs; r++) ensure(int(r * 2 * bs + i), s.read(), "merged");
+	}
+	::unlink(merge_path.c_str());
+
+	// The only job thread is kept busy by a read callback, so a writer of more blocks
+	// than the pool has borrows blocks for the blocks it has queued for writing ...
+	file_stream_term();
+	file_stream_init(1);
+	std::string busy_path = std::string(TMP_FILE) + ".busy";
+	{
+		file<int> busy;
+		busy.open(busy_path, open_flags::truncate | compression_flag);
+		{
+			auto s = busy.stream();
+			for (int i = 0; i < 10; i++) s.write(i);
+		}
+		busy.close();
+		busy.open(busy_path, compression_flag);
+
+		std::atomic_bool started(false), release(false);
+		auto fut = busy.read_async(busy.stream().get_position(), [&]() {
+			started = true;
+			while (!release) std::this_thread::yield();
+		});
+		while (!started) std::this_thread::yield();
+
+		// Opening a file for reading adds the blocks of the cache to the pool,
+		// and a stream of it adds a block it doesn't use yet
+		file<int> f;
+		f.open(TMP_FILE, open_flags::read_only | open_flags::no_readahead | compression_flag);
+		auto s = f.stream();
+
+#ifndef NDEBUG
+		int64_t borrowed = get_total_borrowed_blocks();
+#endif
+		std::atomic_bool written(false);
+		std::thread writer([&]() {
+			file<int> out;
+			out.open(out_path, open_flags::truncate | compression_flag);
+			auto o = out.stream();
+			for (file_size_t i = 0; i < 32 * bs; i++) o.write(int(i));
+			written = true;
+		});
+
+		// ... up to its share, and then waits for its writes
+#ifndef NDEBUG
+		while (get_total_borrowed_blocks() == borrowed) std::this_thread::yield();
+#endif
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		ensure(false, bool(written), "writer waiting");
+
+		// The reader still gets the block its stream added to the pool,
+		// and reads it before any block of the writer is written
+		for (file_size_t i = 0; i < bs; i++) ensure(int(i), s.read(), "read while writer waits");
+		ensure(false, bool(written), "writer still waiting");
+
+		// Moving to the next block borrows a block as well, so it waits for the writes
+		release = true;
+		fut.wait();
+		for (file_size_t i = bs; i < 8 * bs; i++) ensure(int(i), s.read(), "read");
+		writer.join();
+	}
+	::unlink(busy_path.c_str());
+
+	{
+		file<int> out;
+		out.open(out_path, open_flags::read_only | compression_flag);
+		auto s = out.stream();
+		for (file_size_t i = 0; i < 32 * bs; i++) ensure(int(i), s.read(), "written");
+	}
+	::unlink(out_path.c_str());
+
+#ifndef NDEBUG
+	// A file using fewer blocks than it added never waited for one
+	ensure<int64_t>(0, get_total_quota_waits() - waits, "quota waits");
+#endif
+
+	return EXIT_SUCCESS;
+}
+
 typedef int(*test_fun_t)();
 
 std::string current_test;
@@ -886,6 +2582,31 @@ int main(int argc, char ** argv) {
 		{"read_only", test_read_only},
 		{"direct_file2", direct_file2},
 		{"read_seq", read_seq},
+		{"prefetch", prefetch_test},
+		{"coalesced_io", coalesced_io},
+		{"partial_block_writes", partial_block_writes},
+		{"plain_serialized", plain_serialized_test},
+		{"read_async", read_async_test},
+		{"external_sort", external_sort_test},
+		{"kway_merge", kway_merge_test},
+		{"partitioner", partitioner_test},
+		{"partitioner_written_bytes", partitioner_written_bytes},
+		{"staged_serialized", staged_serialized},
+		{"integer_codec", integer_codec},
+		{"byte_shuffle", byte_shuffle},
+		{"block_checksums", block_checksums},
+		{"checkpoint_reopen", checkpoint_reopen},
+		{"concurrent_readers", concurrent_readers},
+		{"parallel_scan", parallel_scan},
+		{"parallel_scan_serialized", parallel_scan_serialized},
+		{"parallel_decompress", parallel_decompress},
+		{"async_close", async_close},
+		{"group_sync", group_sync},
+		{"temporary_file", temporary_file},
+		{"preallocation", preallocation},
+		{"in_memory_file", in_memory_file},
+		{"shared_block_cache", shared_block_cache},
+		{"fair_block_sharing", fair_block_sharing},
 	};
 
 	std::stringstream usage;